@@ -1,70 +1,74 @@
-#include <unistd.h>
-
 #include <algorithm>
 #include <chrono>
 #include <cmath>
-#include <functional>
+#include <iomanip>
 #include <iostream>
 #include <string>
-#include <thread>
-
-const size_t N_RUNS = 1000000;
-
-typedef std::function<double(double)> run_function_t;
-
-double run_tanh(double in)
-{
-    return std::tanh(in);
-}
-
-double run_sigmoid(double in)
-{
-    return 1 / (1 + std::exp(-in));
-}
+#include <vector>
 
-// rectified linear unit
-double run_relu(double in)
-{
-    return std::max(0.0, in);
-}
+#include "tante.hpp"
 
-double run_gaussian(double in)
-{
-    return std::exp(std::pow(-in, 2.0));
-}
+const size_t N_RUNS = 1000000;
+// inputs are drawn from [-MAX_IN, MAX_IN], wider than the table range
+const double MAX_IN = 10;
 
-struct Test {
+struct Backend {
     std::string name;
-    run_function_t f;
-};
-
-Test tests[] = {
-        {"sigmoid ", run_sigmoid},
-        {"relu    ", run_relu},
-        {"gaussian", run_gaussian},
-        {"tanh    ", run_tanh},
+    tante::Activations afs;
 };
 
 int main()
 {
+    tante::Settings exact_settings;
+    exact_settings.af_tables = false;
+    tante::Settings table_settings;
+    table_settings.af_tables = true;
+    Backend backends[] = {
+            {"exact", tante::Activations(exact_settings)},
+            {"table", tante::Activations(table_settings)},
+    };
+
+    std::vector<double> inputs;
+    for (size_t i = 0; i < N_RUNS; i++) {
+        inputs.push_back((rand() / (double)RAND_MAX * 2 - 1) * MAX_IN);
+    }
+
     // this is needed so the code is not optimized out
     static volatile double run_retval;
 
-    std::cout << N_RUNS << " runs average" << std::endl;
-    for (auto t : tests) {
-        size_t total_runtime_ns = 0;
-        for (size_t i = 0; i < N_RUNS; i++) {
-            const double rnd = rand() / (double)rand();
-            auto start       = std::chrono::steady_clock::now();
-            run_retval       = t.f(rnd);
-            auto finish      = std::chrono::steady_clock::now();
-            total_runtime_ns +=
+    std::cout << N_RUNS << " runs average, tables of "
+              << table_settings.af_table_len << " points, tanh on +-"
+              << table_settings.af_table_range << std::endl;
+    for (int afid = 0; afid < tante::Neuron::N_AFS; afid++) {
+        const auto id       = (tante::Neuron::AFID)afid;
+        const auto& exact_f = backends[0].afs.get_af(id);
+        for (const auto& b : backends) {
+            const auto& f = b.afs.get_af(id);
+
+            double sum = 0;
+            auto start = std::chrono::steady_clock::now();
+            for (double in : inputs) {
+                sum += f(in);
+            }
+            auto finish = std::chrono::steady_clock::now();
+            run_retval  = sum;
+
+            double max_error = 0;
+            for (double in : inputs) {
+                max_error =
+                        std::max(max_error, std::abs(f(in) - exact_f(in)));
+            }
+
+            const double avg_runtime_ns =
                     std::chrono::duration_cast<std::chrono::nanoseconds>(
                             finish - start)
-                            .count();
+                            .count() /
+                    (double)N_RUNS;
+            std::cout << std::left << std::setw(12)
+                      << tante::Neuron::AF_NAMES[afid] << std::setw(7)
+                      << b.name << avg_runtime_ns << "ns, max error "
+                      << max_error << std::endl;
         }
-        const double avg_runtime_ns = total_runtime_ns / (double)N_RUNS;
-        std::cout << t.name << " " << avg_runtime_ns << "ns" << std::endl;
     }
 
     (void)run_retval;
@@ -0,0 +1,163 @@
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <new>
+#include <vector>
+
+#include "tante.hpp"
+
+const size_t N_RUNS    = 100000;
+const size_t BATCH_LEN = 64;
+
+// count every heap allocation made by the program.
+// not inlined, otherwise gcc pairs malloc with operator delete and
+// reports -Wmismatched-new-delete
+static size_t g_n_allocs = 0;
+
+[[gnu::noinline]] void* operator new(size_t size)
+{
+    g_n_allocs++;
+    void* p = std::malloc(size);
+    if (p == nullptr) {
+        throw std::bad_alloc();
+    }
+    return p;
+}
+
+[[gnu::noinline]] void operator delete(void* p) noexcept
+{
+    std::free(p);
+}
+
+[[gnu::noinline]] void operator delete(void* p, size_t) noexcept
+{
+    std::free(p);
+}
+
+int main()
+{
+    tante::Settings ts;
+    ts.n_inputs     = 4;
+    ts.n_outputs    = 2;
+    ts.max_n_hidden = 50;
+    for (auto& w : ts.op_weights) {
+        w = 1;
+    }
+    tante::Network n{ts};
+    n.restore_randomly();
+    for (size_t i = 0; i < 1000; i++) {
+        n.apply_operation(tante::Operation::ADD_HIDDEN);
+        n.apply_operation(tante::Operation::ADD_CONNECTION);
+    }
+    n.restore_randomly();
+
+    // this is needed so the code is not optimized out
+    static volatile double run_retval;
+
+    std::vector<double> inputs(ts.n_inputs, 0.5);
+    std::vector<double> outputs(ts.n_outputs, 0);
+    std::cout << N_RUNS << " runs average" << std::endl;
+
+    // vector overload
+    size_t n_allocs = g_n_allocs;
+    auto start      = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < N_RUNS; i++) {
+        run_retval = n.infer(inputs)[0];
+    }
+    auto finish = std::chrono::steady_clock::now();
+    std::cout << "infer(vector)          "
+              << std::chrono::duration_cast<std::chrono::nanoseconds>(
+                         finish - start)
+                                 .count() /
+                         (double)N_RUNS
+              << "ns, " << (g_n_allocs - n_allocs) / (double)N_RUNS
+              << " allocs" << std::endl;
+
+    // span overload with a reused workspace
+    tante::Network::Workspace ws = n.make_workspace();
+    n.infer(inputs, outputs, ws);
+    n_allocs = g_n_allocs;
+    start    = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < N_RUNS; i++) {
+        n.infer(inputs, outputs, ws);
+        run_retval = outputs[0];
+    }
+    finish                   = std::chrono::steady_clock::now();
+    const size_t span_allocs = g_n_allocs - n_allocs;
+    std::cout << "infer(span, workspace) "
+              << std::chrono::duration_cast<std::chrono::nanoseconds>(
+                         finish - start)
+                                 .count() /
+                         (double)N_RUNS
+              << "ns, " << span_allocs / (double)N_RUNS << " allocs"
+              << std::endl;
+
+    // compiled plan
+    const tante::Plan p            = n.compile();
+    tante::Plan::Workspace plan_ws = p.make_workspace(BATCH_LEN);
+    n_allocs                       = g_n_allocs;
+    start                          = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < N_RUNS; i++) {
+        p.infer(inputs, outputs, plan_ws);
+        run_retval = outputs[0];
+    }
+    finish                   = std::chrono::steady_clock::now();
+    const size_t plan_allocs = g_n_allocs - n_allocs;
+    std::cout << "Plan::infer()          "
+              << std::chrono::duration_cast<std::chrono::nanoseconds>(
+                         finish - start)
+                                 .count() /
+                         (double)N_RUNS
+              << "ns, " << plan_allocs / (double)N_RUNS << " allocs"
+              << std::endl;
+
+    // compiled plan, batched
+    std::vector<double> batch_inputs(BATCH_LEN * ts.n_inputs, 0.5);
+    std::vector<double> batch_outputs(BATCH_LEN * ts.n_outputs, 0);
+    n_allocs = g_n_allocs;
+    start    = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < N_RUNS / BATCH_LEN; i++) {
+        p.infer_batch(batch_inputs, batch_outputs, BATCH_LEN, plan_ws);
+        run_retval = batch_outputs[0];
+    }
+    finish                    = std::chrono::steady_clock::now();
+    const size_t batch_allocs = g_n_allocs - n_allocs;
+    std::cout << "Plan::infer_batch()    "
+              << std::chrono::duration_cast<std::chrono::nanoseconds>(
+                         finish - start)
+                                 .count() /
+                         (double)N_RUNS
+              << "ns, " << batch_allocs / (double)N_RUNS << " allocs"
+              << std::endl;
+
+    // streaming loss evaluation
+    tante::Dataset dataset(ts.n_inputs, ts.n_outputs);
+    const std::vector<double> targets(ts.n_outputs, 0.25);
+    for (size_t i = 0; i < N_RUNS; i++) {
+        dataset.add(inputs, targets);
+    }
+    tante::LossEvaluator le(BATCH_LEN);
+    le.evaluate(p, dataset);
+    n_allocs                 = g_n_allocs;
+    start                    = std::chrono::steady_clock::now();
+    run_retval               = le.evaluate(p, dataset).mse;
+    finish                   = std::chrono::steady_clock::now();
+    const size_t loss_allocs = g_n_allocs - n_allocs;
+    std::cout << "LossEvaluator          "
+              << std::chrono::duration_cast<std::chrono::nanoseconds>(
+                         finish - start)
+                                 .count() /
+                         (double)N_RUNS
+              << "ns, " << loss_allocs / (double)N_RUNS << " allocs"
+              << std::endl;
+
+    (void)run_retval;
+
+    // steady-state inference must not allocate
+    if (span_allocs != 0 || plan_allocs != 0 || batch_allocs != 0 ||
+        loss_allocs != 0) {
+        std::cerr << "error: steady-state inference allocated" << std::endl;
+        return 1;
+    }
+    return 0;
+}
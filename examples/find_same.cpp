@@ -1,10 +1,21 @@
+#include <fstream>
+#include <limits>
+
 #include "garaza.hpp"
 #include "lapsa.hpp"
 #include "tante.hpp"
 
 const std::string CONFIG_PATH = "examples/find_same_config.json";
 
-tante::Settings g_ts(CONFIG_PATH, "tante");
+// parse the config once and build all settings from it
+const tante::Config g_config(CONFIG_PATH);
+tante::Settings g_ts = g_config.settings("tante");
+
+// lowest-energy network seen during the run, written to NETWORK_PATH
+// at the end so that it can be served with serve.o
+const std::string NETWORK_PATH = "network.txt";
+tante::Network g_best{g_ts};
+double g_best_energy = std::numeric_limits<double>::infinity();
 
 class MyState : public lapsa::State {
 private:
@@ -24,18 +35,27 @@ public:
             std::vector<double> inputs;
             const double training_data = rand() % 1000;
             inputs.push_back(training_data);
-            assert(inputs.size() == _n.settings.n_inputs);
+            assert(inputs.size() == _n.settings().n_inputs);
             const std::vector<double> outputs = _n.infer(inputs);
-            assert(outputs.size() == _n.settings.n_outputs);
+            assert(outputs.size() == _n.settings().n_outputs);
             // clang-format off
             const double result = outputs[0];
             _energy = std::abs(training_data - result);
             _energy_calculated = true;
             // clang-format on
+            record_best();
         }
         return _energy;
     }
 
+    void record_best()
+    {
+        if (_energy < g_best_energy) {
+            g_best_energy = _energy;
+            g_best        = _n.snapshot();
+        }
+    }
+
     void randomize()
     {
         _n.restore_randomly();
@@ -52,7 +72,7 @@ public:
 
 int main()
 {
-    lapsa::Settings ls{CONFIG_PATH, "lapsa"};
+    lapsa::Settings ls = g_config.lapsa_settings<lapsa::Settings>("lapsa");
     lapsa::StateMachine<MyState> lsm{ls};
     lsm.init_functions = {
             lapsa::init_log<MyState>,
@@ -80,5 +100,8 @@ int main()
             lapsa::create_stats_file<MyState>,
     };
     lsm.run();
+
+    std::ofstream network_file(NETWORK_PATH);
+    g_best.save(network_file);
     return 0;
 }
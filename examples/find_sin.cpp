@@ -1,4 +1,6 @@
 #include <cmath>
+#include <fstream>
+#include <limits>
 
 #include "garaza.hpp"
 #include "lapsa.hpp"
@@ -7,7 +9,32 @@
 
 const std::string CONFIG_PATH = "examples/find_sin_config.json";
 
-tante::Settings g_ts(CONFIG_PATH, "tante");
+// parse the config once and build all settings from it
+const tante::Config g_config(CONFIG_PATH);
+tante::Settings g_ts = g_config.settings("tante");
+
+// lowest-energy network seen during the run, written to NETWORK_PATH
+// at the end so that it can be served with serve.o
+const std::string NETWORK_PATH = "network.txt";
+tante::Network g_best{g_ts};
+double g_best_energy = std::numeric_limits<double>::infinity();
+
+// energy is the mean absolute error over the same training samples for
+// every state, so that energies of different states are comparable.
+// the samples are drawn in main()
+const size_t N_TRAINING_SAMPLES = 256;
+tante::Dataset g_dataset{1, 1};
+
+double get_mae(const tante::Network &n)
+{
+    // buffers of the evaluator are reused between calls
+    static tante::LossEvaluator evaluator;
+    assert(n.settings().n_inputs == g_dataset.n_inputs);
+    assert(n.settings().n_outputs == g_dataset.n_outputs);
+    // compiled once, then reused for every sample
+    const tante::Plan plan = n.compile();
+    return evaluator.evaluate(plan, g_dataset).mae;
+}
 
 class MyState : public lapsa::State {
 private:
@@ -22,23 +49,25 @@ public:
 
     double get_energy()
     {
+        TRACE_SCOPE("get_energy");
+
         // if energy not calculated, do it now and store the result
         if (!_energy_calculated) {
-            std::vector<double> inputs;
-            const double training_data = rododendrs::rnd01() * 10000.0;
-            inputs.push_back(training_data);
-            assert(inputs.size() == _n.settings.n_inputs);
-            const std::vector<double> outputs = _n.infer(inputs);
-            assert(outputs.size() == _n.settings.n_outputs);
-            // clang-format off
-            const double result = outputs[0];
-            _energy = std::abs(std::sin(training_data) - result);
+            _energy            = get_mae(_n);
             _energy_calculated = true;
-            // clang-format on
+            record_best();
         }
         return _energy;
     }
 
+    void record_best()
+    {
+        if (_energy < g_best_energy) {
+            g_best_energy = _energy;
+            g_best        = _n.snapshot();
+        }
+    }
+
     void randomize()
     {
         _n.restore_randomly();
@@ -47,15 +76,24 @@ public:
 
     void change()
     {
-        while (!_n.apply_operation(_n.get_random_operation()));
-        _n.restore_randomly();
+        // a single proposal per step: picking among several with
+        // Network::change_to_neighbour() needs the annealing temperature
+        // to keep lapsa's convergence behaviour, and lapsa does not pass
+        // it to change()
+        _n.change();
         reset_energy();
     }
 };
 
 int main()
 {
-    lapsa::Settings ls{CONFIG_PATH, "lapsa"};
+    for (size_t i = 0; i < N_TRAINING_SAMPLES; i++) {
+        const double training_data = rododendrs::rnd01() * 10000.0;
+        g_dataset.add(std::vector<double>{training_data},
+                      std::vector<double>{std::sin(training_data)});
+    }
+
+    lapsa::Settings ls = g_config.lapsa_settings<lapsa::Settings>("lapsa");
     lapsa::StateMachine<MyState> lsm{ls};
     lsm.init_functions = {
             lapsa::init_log<MyState>,
@@ -83,5 +121,11 @@ int main()
             lapsa::create_stats_file<MyState>,
     };
     lsm.run();
+
+    std::ofstream network_file(NETWORK_PATH);
+    g_best.save(network_file);
+#ifdef TANTE_TRACE
+    tante::trace::write_json("trace.json");
+#endif
     return 0;
 }
@@ -0,0 +1,331 @@
+// serve a saved network over a simple length-prefixed binary protocol.
+//
+// usage: serve.o <config.json> <network.txt> [unix socket path]
+//
+// without a socket path, requests are read from stdin and responses are
+// written to stdout. with one, connections are accepted one at a time.
+//
+// request:  uint32 n_samples, n_samples x n_inputs doubles
+// response: uint32 n_samples, n_samples x n_outputs doubles
+// all values are in native byte order, samples are sample-major.
+// a request with n_samples = 0 ends the stream.
+//
+// reading, inference and writing run on separate threads that pass
+// preallocated batches between each other, so serving does not allocate
+// per sample. throughput and latency counters are printed to stderr at
+// the end of every stream.
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <array>
+#include <chrono>
+#include <condition_variable>
+#include <csignal>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "tante.hpp"
+
+const size_t MAX_BATCH_LEN = 4096;
+// batches in flight: one being read, one inferred, one written, one spare
+const size_t N_BATCHES = 4;
+// latency histogram, buckets grow by 1% from 100ns
+const size_t N_LATENCY_BUCKETS   = 2048;
+const double MIN_LATENCY_NS      = 100;
+const double LATENCY_BUCKET_GROW = 1.01;
+
+struct Batch {
+    std::vector<double> inputs;
+    std::vector<double> outputs;
+    uint32_t n_samples = 0;
+    std::chrono::steady_clock::time_point received;
+};
+
+// fixed capacity queue of batch indices, blocking on empty
+class BatchQueue {
+public:
+    void push(size_t batch_i)
+    {
+        {
+            std::lock_guard<std::mutex> lock(_m);
+            assert(_size < N_BATCHES);
+            _items[(_begin + _size) % N_BATCHES] = batch_i;
+            _size++;
+        }
+        _cv.notify_one();
+    }
+
+    size_t pop()
+    {
+        std::unique_lock<std::mutex> lock(_m);
+        _cv.wait(lock, [this]() { return _size > 0; });
+        const size_t batch_i = _items[_begin];
+        _begin               = (_begin + 1) % N_BATCHES;
+        _size--;
+        return batch_i;
+    }
+
+private:
+    std::array<size_t, N_BATCHES> _items;
+    size_t _begin = 0;
+    size_t _size  = 0;
+    std::mutex _m;
+    std::condition_variable _cv;
+};
+
+class LatencyHistogram {
+public:
+    void record(double ns)
+    {
+        size_t bucket = 0;
+        if (ns > MIN_LATENCY_NS) {
+            bucket = std::log(ns / MIN_LATENCY_NS) /
+                     std::log(LATENCY_BUCKET_GROW);
+        }
+        _counts[std::min(bucket, N_LATENCY_BUCKETS - 1)]++;
+        _n++;
+    }
+
+    double percentile(double p) const
+    {
+        const size_t target = std::ceil(p * _n);
+        size_t n            = 0;
+        for (size_t i = 0; i < N_LATENCY_BUCKETS; i++) {
+            n += _counts[i];
+            if (n >= target && n > 0) {
+                return MIN_LATENCY_NS * std::pow(LATENCY_BUCKET_GROW, i + 1);
+            }
+        }
+        return 0;
+    }
+
+private:
+    std::array<size_t, N_LATENCY_BUCKETS> _counts = {0};
+    size_t _n                                     = 0;
+};
+
+bool read_all(int fd, void* data, size_t len)
+{
+    char* p = (char*)data;
+    while (len > 0) {
+        const ssize_t n = ::read(fd, p, len);
+        if (n <= 0) {
+            return false;
+        }
+        p += n;
+        len -= n;
+    }
+    return true;
+}
+
+bool write_all(int fd, const void* data, size_t len)
+{
+    const char* p = (const char*)data;
+    while (len > 0) {
+        const ssize_t n = ::write(fd, p, len);
+        if (n <= 0) {
+            return false;
+        }
+        p += n;
+        len -= n;
+    }
+    return true;
+}
+
+void serve(int in_fd, int out_fd, const tante::Plan& plan)
+{
+    const size_t n_inputs  = plan.input_slots.size();
+    const size_t n_outputs = plan.output_slots.size();
+
+    std::array<Batch, N_BATCHES> batches;
+    BatchQueue free_q;
+    BatchQueue read_q;
+    BatchQueue inferred_q;
+    for (size_t i = 0; i < N_BATCHES; i++) {
+        batches[i].inputs.resize(MAX_BATCH_LEN * n_inputs);
+        batches[i].outputs.resize(MAX_BATCH_LEN * n_outputs);
+        free_q.push(i);
+    }
+
+    LatencyHistogram latency;
+    size_t n_samples_total = 0;
+    size_t n_batches_total = 0;
+    // throughput is measured from the first request to the last response,
+    // time spent waiting for the client to start is not counted
+    std::chrono::steady_clock::time_point first_received;
+    std::chrono::steady_clock::time_point last_written;
+
+    // a batch with n_samples = 0 marks the end of the stream
+    std::thread reader([&]() {
+        while (true) {
+            const size_t batch_i = free_q.pop();
+            Batch& b             = batches[batch_i];
+            if (!read_all(in_fd, &b.n_samples, sizeof(b.n_samples))) {
+                b.n_samples = 0;
+            }
+            if (b.n_samples > MAX_BATCH_LEN) {
+                std::cerr << "error: batch of " << b.n_samples
+                          << " samples exceeds " << MAX_BATCH_LEN
+                          << std::endl;
+                b.n_samples = 0;
+            }
+            if (b.n_samples > 0 &&
+                !read_all(in_fd,
+                          b.inputs.data(),
+                          b.n_samples * n_inputs * sizeof(double))) {
+                b.n_samples = 0;
+            }
+            b.received     = std::chrono::steady_clock::now();
+            const bool end = b.n_samples == 0;
+            read_q.push(batch_i);
+            if (end) {
+                return;
+            }
+        }
+    });
+
+    // once a write fails the peer is gone, remaining batches are drained
+    // without writing so that the reader and inference can finish
+    std::thread writer([&]() {
+        bool write_ok = true;
+        while (true) {
+            const size_t batch_i = inferred_q.pop();
+            const Batch& b       = batches[batch_i];
+            if (b.n_samples == 0) {
+                return;
+            }
+            if (write_ok) {
+                write_ok =
+                        write_all(out_fd, &b.n_samples, sizeof(b.n_samples)) &&
+                        write_all(out_fd,
+                                  b.outputs.data(),
+                                  b.n_samples * n_outputs * sizeof(double));
+                if (!write_ok) {
+                    std::cerr << "error: failed to write response, "
+                                 "dropping the rest of the stream"
+                              << std::endl;
+                }
+            }
+            if (write_ok) {
+                last_written = std::chrono::steady_clock::now();
+                latency.record(
+                        std::chrono::duration_cast<std::chrono::nanoseconds>(
+                                last_written - b.received)
+                                .count());
+                if (n_batches_total == 0) {
+                    first_received = b.received;
+                }
+                n_samples_total += b.n_samples;
+                n_batches_total++;
+            }
+            free_q.push(batch_i);
+        }
+    });
+
+    // inference runs on the calling thread
+    tante::Plan::Workspace ws = plan.make_workspace(MAX_BATCH_LEN);
+    while (true) {
+        const size_t batch_i = read_q.pop();
+        Batch& b             = batches[batch_i];
+        if (b.n_samples > 0) {
+            plan.infer_batch(
+                    std::span(b.inputs.data(), b.n_samples * n_inputs),
+                    std::span(b.outputs.data(), b.n_samples * n_outputs),
+                    b.n_samples,
+                    ws);
+        }
+        // the batch may be reused as soon as it is pushed
+        const bool end = b.n_samples == 0;
+        inferred_q.push(batch_i);
+        if (end) {
+            break;
+        }
+    }
+
+    reader.join();
+    writer.join();
+
+    const double elapsed_s =
+            std::chrono::duration<double>(last_written - first_received)
+                    .count();
+    std::cerr << "served " << n_samples_total << " samples in "
+              << n_batches_total << " batches, "
+              << ((elapsed_s > 0) ? n_samples_total / elapsed_s : 0)
+              << " samples/s, "
+              << "batch latency p50 " << latency.percentile(0.50) / 1000
+              << "us p99 " << latency.percentile(0.99) / 1000 << "us"
+              << std::endl;
+}
+
+int main(int argc, char* argv[])
+{
+    if (argc < 3 || argc > 4) {
+        std::cerr << "usage: " << argv[0]
+                  << " <config.json> <network.txt> [unix socket path]"
+                  << std::endl;
+        return 1;
+    }
+
+    // a client that disconnects early must not kill the server,
+    // failed writes are handled in serve()
+    std::signal(SIGPIPE, SIG_IGN);
+
+    tante::Settings ts;
+    try {
+        ts = tante::Config(argv[1]).settings("tante");
+    }
+    catch (const std::runtime_error& e) {
+        std::cerr << "error: " << e.what() << std::endl;
+        return 1;
+    }
+    tante::Network n{ts};
+    std::ifstream network_file(argv[2]);
+    if (!network_file) {
+        std::cerr << "error: failed to open " << argv[2] << std::endl;
+        return 1;
+    }
+    try {
+        n.load(network_file);
+    }
+    catch (const std::runtime_error& e) {
+        std::cerr << "error: " << argv[2] << ": " << e.what() << std::endl;
+        return 1;
+    }
+    if (!n.is_operational()) {
+        std::cerr << "error: network is not operational" << std::endl;
+        return 1;
+    }
+    const tante::Plan plan = n.compile();
+
+    if (argc == 3) {
+        serve(STDIN_FILENO, STDOUT_FILENO, plan);
+        return 0;
+    }
+
+    const int listen_fd = ::socket(AF_UNIX, SOCK_STREAM, 0);
+    sockaddr_un addr    = {};
+    addr.sun_family     = AF_UNIX;
+    std::strncpy(addr.sun_path, argv[3], sizeof(addr.sun_path) - 1);
+    ::unlink(argv[3]);
+    if (listen_fd < 0 || ::bind(listen_fd, (sockaddr*)&addr, sizeof(addr)) ||
+        ::listen(listen_fd, 1)) {
+        std::cerr << "error: failed to listen on " << argv[3] << std::endl;
+        return 1;
+    }
+    while (true) {
+        const int fd = ::accept(listen_fd, nullptr, nullptr);
+        if (fd < 0) {
+            break;
+        }
+        serve(fd, fd, plan);
+        ::close(fd);
+    }
+    ::close(listen_fd);
+    return 0;
+}
@@ -1,9 +1,29 @@
+#include <algorithm>
 #include <array>
+#include <atomic>
 #include <cassert>
+#include <charconv>
+#include <chrono>
+#include <cmath>
+#include <condition_variable>
+#include <cstdint>
+#include <fstream>
 #include <functional>
+#include <iomanip>
+#include <istream>
+#include <limits>
 #include <map>
+#include <memory>
+#include <mutex>
 #include <optional>
+#include <ostream>
 #include <queue>
+#include <set>
+#include <span>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <thread>
 #include <vector>
 
 // #define PRINT_DEBUGS
@@ -16,13 +36,176 @@
 #define DEBUG(x)
 #endif
 
+// chrome trace-event profiling, load the output of trace::write_json()
+// in chrome://tracing or ui.perfetto.dev.
+// scopes are only recorded if TANTE_TRACE is defined
+// #define TANTE_TRACE
+#ifdef TANTE_TRACE
+#define TRACE_CONCAT_(a, b) a##b
+#define TRACE_CONCAT(a, b)  TRACE_CONCAT_(a, b)
+#define TRACE_SCOPE(name) \
+    tante::trace::Scope TRACE_CONCAT(_trace_scope_, __LINE__)(name)
+#else
+#define TRACE_SCOPE(name)
+#endif
+
 #include "garaza.hpp"
 #include "grafiins.hpp"
-#include "iestade.hpp"
 #include "rododendrs.hpp"
 
 namespace tante {
 
+namespace trace {
+
+// events kept per thread, older ones are overwritten
+const size_t RING_LEN = 1 << 16;
+
+struct Event {
+    // must point to a string literal
+    const char* name = nullptr;
+    int64_t begin_ns = 0;
+    int64_t end_ns   = 0;
+};
+
+// written only by its own thread, so recording needs no locks.
+// n_written is published with release semantics for write_json()
+struct Ring {
+    size_t tid = 0;
+    std::array<Event, RING_LEN> events;
+    std::atomic<size_t> n_written = 0;
+};
+
+struct Registry {
+    std::mutex m;
+    std::vector<std::unique_ptr<Ring>> rings;
+};
+
+inline Registry& registry()
+{
+    static Registry r;
+    return r;
+}
+
+inline int64_t now_ns()
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+                   std::chrono::steady_clock::now().time_since_epoch())
+            .count();
+}
+
+// ring of the calling thread, registered on first use.
+// rings outlive their threads so that events can be written at the end
+inline Ring& thread_ring()
+{
+    thread_local Ring* ring = nullptr;
+    if (ring == nullptr) {
+        Registry& r = registry();
+        std::lock_guard<std::mutex> lock(r.m);
+        r.rings.push_back(std::make_unique<Ring>());
+        ring      = r.rings.back().get();
+        ring->tid = r.rings.size();
+    }
+    return *ring;
+}
+
+inline void record(const char* name, int64_t begin_ns, int64_t end_ns)
+{
+    Ring& ring     = thread_ring();
+    const size_t i = ring.n_written.load(std::memory_order_relaxed);
+    ring.events[i % RING_LEN] = {name, begin_ns, end_ns};
+    ring.n_written.store(i + 1, std::memory_order_release);
+}
+
+// records the time between its construction and destruction
+class Scope {
+public:
+    Scope(const char* name) :
+        _name(name),
+        _begin_ns(now_ns())
+    {
+    }
+
+    ~Scope()
+    {
+        record(_name, _begin_ns, now_ns());
+    }
+
+    Scope(const Scope&)            = delete;
+    Scope& operator=(const Scope&) = delete;
+
+private:
+    const char* _name;
+    int64_t _begin_ns;
+};
+
+// write recorded events of all threads as chrome trace-event json.
+// every ring keeps the last RING_LEN events of its thread, so a thread
+// that records often covers a shorter period than one that records
+// rarely. events are recorded when they end, so a ring holds every event
+// of its thread that ended after its oldest one. events that ended
+// before the shortest covered period are skipped, so that all threads
+// are shown over the same time window. enclosing events that began
+// earlier but ended within the window are kept.
+// call when no traced code is running
+inline void write_json(std::ostream& os)
+{
+    Registry& r = registry();
+    std::lock_guard<std::mutex> lock(r.m);
+
+    // start of the window covered by all rings
+    int64_t window_begin_ns = std::numeric_limits<int64_t>::min();
+    for (const auto& ring : r.rings) {
+        const size_t n = ring->n_written.load(std::memory_order_acquire);
+        if (n > RING_LEN) {
+            window_begin_ns = std::max(window_begin_ns,
+                                       ring->events[n % RING_LEN].end_ns);
+        }
+    }
+
+    int64_t t0 = std::numeric_limits<int64_t>::max();
+    for (const auto& ring : r.rings) {
+        const size_t n = ring->n_written.load(std::memory_order_acquire);
+        for (size_t i = n - std::min(n, RING_LEN); i < n; i++) {
+            const Event& e = ring->events[i % RING_LEN];
+            if (e.end_ns >= window_begin_ns) {
+                t0 = std::min(t0, e.begin_ns);
+            }
+        }
+    }
+
+    // timestamps are in microseconds, written with full ns resolution
+    const auto flags     = os.flags();
+    const auto precision = os.precision();
+    os << std::fixed << std::setprecision(3);
+    os << "{\"traceEvents\":[";
+    bool first = true;
+    for (const auto& ring : r.rings) {
+        const size_t n = ring->n_written.load(std::memory_order_acquire);
+        for (size_t i = n - std::min(n, RING_LEN); i < n; i++) {
+            const Event& e = ring->events[i % RING_LEN];
+            if (e.end_ns < window_begin_ns) {
+                continue;
+            }
+            os << (first ? "\n" : ",\n") << "{\"name\":\"" << e.name
+               << "\",\"ph\":\"X\",\"pid\":1,\"tid\":" << ring->tid
+               << ",\"ts\":" << (e.begin_ns - t0) / 1000.0
+               << ",\"dur\":" << (e.end_ns - e.begin_ns) / 1000.0 << "}";
+            first = false;
+        }
+    }
+    os << "\n],\"displayTimeUnit\":\"ns\"}\n";
+    os.flags(flags);
+    os.precision(precision);
+}
+
+inline void write_json(const std::string& filepath)
+{
+    std::ofstream f(filepath);
+    write_json(f);
+}
+
+}  // namespace trace
+
 enum Operation {
     ADD_INPUT = 0,
     RM_INPUT,
@@ -39,6 +222,8 @@ enum Operation {
     N_OPS,
 };
 
+class Activations;
+
 class Neuron : public grafiins::Vertex {
 public:
     typedef std::function<double(double)> ActivationF;
@@ -47,18 +232,44 @@ public:
         AF_TANH   = 0,
         AF_SIGMOID,
         AF_RELU,
+        AF_GAUSSIAN,
+        AF_SOFTSIGN,
+        AF_LEAKY_RELU,
+        AF_IDENTITY,
         N_AFS,
     };
+    // names used in configuration files
+    static constexpr const char* AF_NAMES[N_AFS] = {
+            "tanh",
+            "sigmoid",
+            "relu",
+            "gaussian",
+            "softsign",
+            "leaky_relu",
+            "identity",
+    };
+    static constexpr double LEAKY_RELU_SLOPE = 0.01;
+    // AF_RANDOM chooses from the first N_BASIC_AFS functions (tanh,
+    // sigmoid and relu) unless configured otherwise, see Activations
+    static constexpr int N_BASIC_AFS = AF_RELU + 1;
 
+    // never AF_RANDOM, the random choice is resolved on construction
+    AFID afid;
     ActivationF activation_f;
-    double bias = 0;
 
-    Neuron(AFID afid = AF_TANH, std::string label = "") :
+    Neuron(AFID in_afid = AF_TANH, std::string label = "") :
         Vertex(label),
-        activation_f(_get_af(afid))
+        afid(in_afid == AF_RANDOM
+                     ? (AFID)(rododendrs::rnd01() * (double)N_BASIC_AFS)
+                     : in_afid),
+        activation_f(get_af(afid))
     {
     }
 
+    // use activation functions configured for the network,
+    // see Activations
+    Neuron(AFID in_afid, const Activations& afs);
+
     static double af_tanh(double in)
     {
         return std::tanh(in);
@@ -74,14 +285,34 @@ public:
         return std::max(0.0, in);
     }
 
-private:
-    ActivationF _get_af(AFID afid)
+    static double af_gaussian(double in)
+    {
+        return std::exp(-in * in);
+    }
+
+    static double af_softsign(double in)
+    {
+        return in / (1 + std::abs(in));
+    }
+
+    static double af_leaky_relu(double in)
+    {
+        return (in > 0) ? in : LEAKY_RELU_SLOPE * in;
+    }
+
+    static double af_identity(double in)
     {
-        const int rnd_afid = rododendrs::rnd01() * (double)N_AFS;
+        return in;
+    }
+
+    // exact activation function computed with libm
+    static ActivationF get_af(AFID afid)
+    {
+        const int rnd_afid = rododendrs::rnd01() * (double)N_BASIC_AFS;
         ActivationF af;
         switch (afid) {
             case AF_RANDOM:
-                af = _get_af((AFID)rnd_afid);
+                af = get_af((AFID)rnd_afid);
                 break;
             case AF_TANH:
                 af = af_tanh;
@@ -92,147 +323,1320 @@ private:
             case AF_RELU:
                 af = af_relu;
                 break;
+            case AF_GAUSSIAN:
+                af = af_gaussian;
+                break;
+            case AF_SOFTSIGN:
+                af = af_softsign;
+                break;
+            case AF_LEAKY_RELU:
+                af = af_leaky_relu;
+                break;
+            case AF_IDENTITY:
+                af = af_identity;
+                break;
             case N_AFS:
             default:
                 assert(false);
                 break;
         }
 
-        return af;
+        return af;
+    }
+};
+
+// precomputed values of a function on [-range, range], linearly
+// interpolated in between and clamped outside
+class ActivationTable {
+public:
+    ActivationTable(double (*f)(double), double range, size_t len) :
+        _min(-range),
+        _max(range),
+        _inv_step((len - 1) / (2 * range))
+    {
+        assert(range > 0);
+        assert(len >= 2);
+        _values.resize(len + 1);
+        for (size_t i = 0; i < len; i++) {
+            _values[i] = f(_min + i / _inv_step);
+        }
+        // guards interpolation at x == range
+        _values[len] = _values[len - 1];
+    }
+
+    double operator()(double x) const
+    {
+        // clamp passes nan through, it must not be used as an index
+        if (std::isnan(x)) {
+            return x;
+        }
+        x              = std::clamp(x, _min, _max);
+        const double t = (x - _min) * _inv_step;
+        const size_t i = t;
+        const double w = t - i;
+        return _values[i] + w * (_values[i + 1] - _values[i]);
+    }
+
+private:
+    double _min;
+    double _max;
+    double _inv_step;
+    std::vector<double> _values;
+};
+
+// weights of connections and biases of neurons are kept by Network,
+// outside of the graph, see Network::_weights
+class Connection : public grafiins::Edge {
+public:
+    Connection(size_t src_i, size_t dst_i, std::string label = "") :
+        Edge(src_i, dst_i, label)
+    {
+    }
+
+    Connection() :
+        Connection(0, 0)
+    {
+    }
+};
+
+struct Settings {
+    size_t n_inputs                     = 1;
+    size_t n_outputs                    = 1;
+    size_t max_n_hidden                 = 10;
+    double min_init_weight              = -10;
+    double max_init_weight              = 10;
+    bool limit_weight                   = false;
+    bool limit_bias                     = false;
+    double min_weight                   = -100;
+    double max_weight                   = 100;
+    double min_bias                     = -100;
+    double max_bias                     = 100;
+    double min_weight_step              = -10;
+    double max_weight_step              = 10;
+    double min_bias_step                = -10;
+    double max_bias_step                = 10;
+    size_t max_op_weight                = 100;
+    size_t op_weights[Operation::N_OPS] = {1};
+    Neuron::AFID neuron_afid            = Neuron::AFID::AF_SIGMOID;
+    // compact the network once fragmentation() exceeds this value,
+    // 1 or more disables automatic compaction
+    double max_fragmentation = 0.5;
+    // share of possible connections a layer needs to be evaluated as a
+    // dense matrix, see Plan
+    double min_dense_density = 0.5;
+    // activation functions AF_RANDOM chooses from
+    std::vector<Neuron::AFID> random_afids = {
+            Neuron::AFID::AF_TANH,
+            Neuron::AFID::AF_SIGMOID,
+            Neuron::AFID::AF_RELU,
+    };
+    // compute tanh, sigmoid and gaussian from interpolated lookup tables
+    // of af_table_len points. tanh is tabulated on
+    // [-af_table_range, af_table_range], sigmoid and gaussian on ranges
+    // scaled to where they saturate equally, see Activations
+    bool af_tables        = false;
+    size_t af_table_len   = 4096;
+    double af_table_range = 8;
+
+    Settings() {}
+
+    // parses the file once, see Config
+    Settings(const std::string& config_filepath,
+             const std::string& key_path_prefix);
+};
+
+// minimal strict json (rfc 8259) document, sufficient for configuration
+// files. duplicate keys and non-finite numbers are rejected
+class Json {
+public:
+    enum Type {
+        NUL = 0,
+        BOOL,
+        NUMBER,
+        STRING,
+        ARRAY,
+        OBJECT,
+    };
+
+    Type type     = NUL;
+    bool boolean  = false;
+    double number = 0;
+    std::string string;
+    std::vector<Json> array;
+    std::map<std::string, Json> object;
+
+    static Json parse(const std::string& text)
+    {
+        size_t pos        = 0;
+        const Json retval = _parse_value(text, pos);
+        _skip_whitespace(text, pos);
+        if (pos != text.size()) {
+            _fail(text, pos, "unexpected trailing characters");
+        }
+        return retval;
+    }
+
+    // return value at key path like "tante/op_weights/add_input",
+    // or nullptr if there is none
+    const Json* find(const std::string& key_path) const
+    {
+        const Json* retval = this;
+        size_t begin       = 0;
+        while (begin <= key_path.size()) {
+            size_t end = key_path.find('/', begin);
+            if (end == std::string::npos) {
+                end = key_path.size();
+            }
+            const std::string key = key_path.substr(begin, end - begin);
+            begin                 = end + 1;
+            if (key.empty()) {
+                continue;
+            }
+            if (retval->type != OBJECT) {
+                return nullptr;
+            }
+            const auto it = retval->object.find(key);
+            if (it == retval->object.end()) {
+                return nullptr;
+            }
+            retval = &it->second;
+        }
+        return retval;
+    }
+
+private:
+    [[noreturn]] static void _fail(const std::string& text,
+                                   size_t pos,
+                                   const std::string& what)
+    {
+        const size_t line =
+                1 + std::count(text.begin(),
+                               text.begin() + std::min(pos, text.size()),
+                               '\n');
+        throw std::runtime_error("json: line " + std::to_string(line) +
+                                 ": " + what);
+    }
+
+    static void _skip_whitespace(const std::string& text, size_t& pos)
+    {
+        while (pos < text.size() &&
+               (text[pos] == ' ' || text[pos] == '\t' || text[pos] == '\n' ||
+                text[pos] == '\r')) {
+            pos++;
+        }
+    }
+
+    static void _expect(const std::string& text, size_t& pos, char c)
+    {
+        _skip_whitespace(text, pos);
+        if (pos >= text.size() || text[pos] != c) {
+            _fail(text, pos, std::string("expected '") + c + "'");
+        }
+        pos++;
+    }
+
+    static std::string _parse_string(const std::string& text, size_t& pos)
+    {
+        _expect(text, pos, '"');
+        std::string retval;
+        while (pos < text.size() && text[pos] != '"') {
+            char c = text[pos++];
+            if ((unsigned char)c < 0x20) {
+                _fail(text, pos, "control character in string");
+            }
+            if (c == '\\') {
+                if (pos >= text.size()) {
+                    break;
+                }
+                c = text[pos++];
+                switch (c) {
+                    case '"':
+                    case '\\':
+                    case '/':
+                        break;
+                    case 'b':
+                        c = '\b';
+                        break;
+                    case 'f':
+                        c = '\f';
+                        break;
+                    case 'n':
+                        c = '\n';
+                        break;
+                    case 'r':
+                        c = '\r';
+                        break;
+                    case 't':
+                        c = '\t';
+                        break;
+                    case 'u':
+                        _append_utf8(retval, _parse_code_point(text, pos));
+                        continue;
+                    default:
+                        _fail(text, pos, "invalid escape");
+                }
+            }
+            retval.push_back(c);
+        }
+        _expect(text, pos, '"');
+        return retval;
+    }
+
+    static uint32_t _parse_hex4(const std::string& text, size_t& pos)
+    {
+        if (pos + 4 > text.size()) {
+            _fail(text, pos, "invalid unicode escape");
+        }
+        uint32_t retval = 0;
+        for (size_t i = 0; i < 4; i++) {
+            const char c = text[pos + i];
+            retval <<= 4;
+            if (c >= '0' && c <= '9') {
+                retval |= c - '0';
+            }
+            else if (c >= 'a' && c <= 'f') {
+                retval |= c - 'a' + 10;
+            }
+            else if (c >= 'A' && c <= 'F') {
+                retval |= c - 'A' + 10;
+            }
+            else {
+                _fail(text, pos, "invalid unicode escape");
+            }
+        }
+        pos += 4;
+        return retval;
+    }
+
+    // code point of a \u escape, utf-16 surrogate pairs are combined
+    static uint32_t _parse_code_point(const std::string& text, size_t& pos)
+    {
+        const uint32_t hi = _parse_hex4(text, pos);
+        if (hi >= 0xdc00 && hi <= 0xdfff) {
+            _fail(text, pos, "unpaired utf-16 surrogate");
+        }
+        if (hi < 0xd800 || hi > 0xdbff) {
+            return hi;
+        }
+        if (text.compare(pos, 2, "\\u") != 0) {
+            _fail(text, pos, "unpaired utf-16 surrogate");
+        }
+        pos += 2;
+        const uint32_t lo = _parse_hex4(text, pos);
+        if (lo < 0xdc00 || lo > 0xdfff) {
+            _fail(text, pos, "unpaired utf-16 surrogate");
+        }
+        return 0x10000 + ((hi - 0xd800) << 10) + (lo - 0xdc00);
+    }
+
+    static void _append_utf8(std::string& s, uint32_t cp)
+    {
+        if (cp < 0x80) {
+            s.push_back((char)cp);
+        }
+        else if (cp < 0x800) {
+            s.push_back((char)(0xc0 | (cp >> 6)));
+            s.push_back((char)(0x80 | (cp & 0x3f)));
+        }
+        else if (cp < 0x10000) {
+            s.push_back((char)(0xe0 | (cp >> 12)));
+            s.push_back((char)(0x80 | ((cp >> 6) & 0x3f)));
+            s.push_back((char)(0x80 | (cp & 0x3f)));
+        }
+        else {
+            s.push_back((char)(0xf0 | (cp >> 18)));
+            s.push_back((char)(0x80 | ((cp >> 12) & 0x3f)));
+            s.push_back((char)(0x80 | ((cp >> 6) & 0x3f)));
+            s.push_back((char)(0x80 | (cp & 0x3f)));
+        }
+    }
+
+    static Json _parse_value(const std::string& text, size_t& pos)
+    {
+        _skip_whitespace(text, pos);
+        if (pos >= text.size()) {
+            _fail(text, pos, "unexpected end of input");
+        }
+
+        Json retval;
+        const char c = text[pos];
+        if (c == '{') {
+            retval.type = OBJECT;
+            pos++;
+            _skip_whitespace(text, pos);
+            if (pos < text.size() && text[pos] == '}') {
+                pos++;
+                return retval;
+            }
+            while (true) {
+                const std::string key = _parse_string(text, pos);
+                if (retval.object.contains(key)) {
+                    _fail(text, pos, "duplicate key \"" + key + "\"");
+                }
+                _expect(text, pos, ':');
+                retval.object[key] = _parse_value(text, pos);
+                _skip_whitespace(text, pos);
+                if (pos < text.size() && text[pos] == ',') {
+                    pos++;
+                    continue;
+                }
+                _expect(text, pos, '}');
+                return retval;
+            }
+        }
+        if (c == '[') {
+            retval.type = ARRAY;
+            pos++;
+            _skip_whitespace(text, pos);
+            if (pos < text.size() && text[pos] == ']') {
+                pos++;
+                return retval;
+            }
+            while (true) {
+                retval.array.push_back(_parse_value(text, pos));
+                _skip_whitespace(text, pos);
+                if (pos < text.size() && text[pos] == ',') {
+                    pos++;
+                    continue;
+                }
+                _expect(text, pos, ']');
+                return retval;
+            }
+        }
+        if (c == '"') {
+            retval.type   = STRING;
+            retval.string = _parse_string(text, pos);
+            return retval;
+        }
+        if (text.compare(pos, 4, "true") == 0) {
+            retval.type    = BOOL;
+            retval.boolean = true;
+            pos += 4;
+            return retval;
+        }
+        if (text.compare(pos, 5, "false") == 0) {
+            retval.type = BOOL;
+            pos += 5;
+            return retval;
+        }
+        if (text.compare(pos, 4, "null") == 0) {
+            pos += 4;
+            return retval;
+        }
+
+        retval.type   = NUMBER;
+        retval.number = _parse_number(text, pos);
+        return retval;
+    }
+
+    // number as defined by rfc 8259, converted independently of the
+    // locale. values that do not fit a finite double are rejected
+    static double _parse_number(const std::string& text, size_t& pos)
+    {
+        auto digits = [&text](size_t& i) {
+            const size_t begin = i;
+            while (i < text.size() && text[i] >= '0' && text[i] <= '9') {
+                i++;
+            }
+            return i - begin;
+        };
+
+        size_t i = pos;
+        if (i < text.size() && text[i] == '-') {
+            i++;
+        }
+        const size_t int_begin = i;
+        const size_t n_int     = digits(i);
+        if (n_int == 0) {
+            _fail(text, pos, "unexpected character");
+        }
+        if (n_int > 1 && text[int_begin] == '0') {
+            _fail(text, pos, "leading zeros in number");
+        }
+        if (i < text.size() && text[i] == '.') {
+            i++;
+            if (digits(i) == 0) {
+                _fail(text, pos, "digits expected after '.'");
+            }
+        }
+        if (i < text.size() && (text[i] == 'e' || text[i] == 'E')) {
+            i++;
+            if (i < text.size() && (text[i] == '+' || text[i] == '-')) {
+                i++;
+            }
+            if (digits(i) == 0) {
+                _fail(text, pos, "digits expected in exponent");
+            }
+        }
+
+        double retval       = 0;
+        const char* begin   = text.data() + pos;
+        const auto [end, e] = std::from_chars(begin, text.data() + i, retval);
+        if (e != std::errc() || end != text.data() + i ||
+            !std::isfinite(retval)) {
+            _fail(text, pos, "number out of range");
+        }
+        pos = i;
+        return retval;
+    }
+};
+
+// configuration file parsed once into memory, any number of settings
+// can then be built from it without touching the file again.
+// every field is validated and all errors are reported in a single
+// std::runtime_error, including keys that are not recognised, so that
+// misspelled keys are not silently replaced by defaults.
+class Config {
+public:
+    std::string filepath;
+    Json doc;
+
+    Config(const std::string& config_filepath) :
+        filepath(config_filepath)
+    {
+        std::ifstream f(config_filepath);
+        if (!f) {
+            throw std::runtime_error("failed to open " + config_filepath);
+        }
+        std::stringstream ss;
+        ss << f.rdbuf();
+        try {
+            doc = Json::parse(ss.str());
+        }
+        catch (const std::runtime_error& e) {
+            throw std::runtime_error(config_filepath + ": " + e.what());
+        }
+    }
+
+    Settings settings(const std::string& key_path_prefix) const
+    {
+        const std::string& p = key_path_prefix;
+        std::vector<std::string> errors;
+        std::set<std::string> keys;
+        Settings s;
+        auto read = [&](const std::string& key, auto& field, bool required) {
+            keys.insert(p + "/" + key);
+            _read(p + "/" + key, field, errors, required);
+        };
+
+        // keys added after the first release are optional and keep the
+        // defaults of Settings, so older configuration files remain valid
+        // clang-format off
+        read("n_inputs",          s.n_inputs,          REQUIRED);
+        read("n_outputs",         s.n_outputs,         REQUIRED);
+        read("max_n_hidden",      s.max_n_hidden,      REQUIRED);
+        read("min_init_weight",   s.min_init_weight,   REQUIRED);
+        read("max_init_weight",   s.max_init_weight,   REQUIRED);
+        read("limit_weight",      s.limit_weight,      REQUIRED);
+        read("limit_bias",        s.limit_bias,        REQUIRED);
+        read("min_weight",        s.min_weight,        REQUIRED);
+        read("max_weight",        s.max_weight,        REQUIRED);
+        read("min_bias",          s.min_bias,          REQUIRED);
+        read("max_bias",          s.max_bias,          REQUIRED);
+        read("min_weight_step",   s.min_weight_step,   REQUIRED);
+        read("max_weight_step",   s.max_weight_step,   REQUIRED);
+        read("min_bias_step",     s.min_bias_step,     REQUIRED);
+        read("max_bias_step",     s.max_bias_step,     REQUIRED);
+        read("max_op_weight",     s.max_op_weight,     REQUIRED);
+        read("max_fragmentation", s.max_fragmentation, OPTIONAL);
+        read("min_dense_density", s.min_dense_density, OPTIONAL);
+        read("neuron_af",         s.neuron_afid,       OPTIONAL);
+        read("random_afs",        s.random_afids,      OPTIONAL);
+        read("af_tables",         s.af_tables,         OPTIONAL);
+        read("af_table_len",      s.af_table_len,      OPTIONAL);
+        read("af_table_range",    s.af_table_range,    OPTIONAL);
+        read("op_weights/add_input",      s.op_weights[Operation::ADD_INPUT],      REQUIRED);
+        read("op_weights/rm_input",       s.op_weights[Operation::RM_INPUT],       REQUIRED);
+        read("op_weights/add_output",     s.op_weights[Operation::ADD_OUTPUT],     REQUIRED);
+        read("op_weights/rm_output",      s.op_weights[Operation::RM_OUTPUT],      REQUIRED);
+        read("op_weights/add_hidden",     s.op_weights[Operation::ADD_HIDDEN],     REQUIRED);
+        read("op_weights/rm_hidden",      s.op_weights[Operation::RM_HIDDEN],      REQUIRED);
+        read("op_weights/add_connection", s.op_weights[Operation::ADD_CONNECTION], REQUIRED);
+        read("op_weights/rm_connection",  s.op_weights[Operation::RM_CONNECTION],  REQUIRED);
+        read("op_weights/step_weight",    s.op_weights[Operation::STEP_WEIGHT],    REQUIRED);
+        read("op_weights/step_bias",      s.op_weights[Operation::STEP_BIAS],      REQUIRED);
+        read("op_weights/rnd_weight",     s.op_weights[Operation::RND_WEIGHT],     REQUIRED);
+        read("op_weights/rnd_bias",       s.op_weights[Operation::RND_BIAS],       REQUIRED);
+        // clang-format on
+        _check_unknown(p, keys, errors);
+
+        // the same requirements as asserted by Network
+        _check(s.n_inputs > 0, p + "/n_inputs must be > 0", errors);
+        _check(s.n_outputs > 0, p + "/n_outputs must be > 0", errors);
+        _check(s.max_n_hidden > 0, p + "/max_n_hidden must be > 0", errors);
+        _check(s.max_op_weight > 0, p + "/max_op_weight must be > 0", errors);
+        for (auto w : s.op_weights) {
+            if (w > s.max_op_weight) {
+                errors.push_back(p + "/op_weights must be <= max_op_weight");
+                break;
+            }
+        }
+        _check(s.min_init_weight <= s.max_init_weight,
+               p + "/min_init_weight must be <= max_init_weight",
+               errors);
+        _check(!s.limit_weight || s.min_weight <= s.max_weight,
+               p + "/min_weight must be <= max_weight",
+               errors);
+        _check(!s.limit_bias || s.min_bias <= s.max_bias,
+               p + "/min_bias must be <= max_bias",
+               errors);
+        _check(s.min_weight_step <= s.max_weight_step,
+               p + "/min_weight_step must be <= max_weight_step",
+               errors);
+        _check(s.min_bias_step <= s.max_bias_step,
+               p + "/min_bias_step must be <= max_bias_step",
+               errors);
+        _check(s.min_dense_density >= 0,
+               p + "/min_dense_density must be >= 0",
+               errors);
+        _check(!s.random_afids.empty(),
+               p + "/random_afs must not be empty",
+               errors);
+        _check(s.af_table_len >= 2, p + "/af_table_len must be >= 2", errors);
+        _check(s.af_table_range > 0,
+               p + "/af_table_range must be > 0",
+               errors);
+
+        _throw_if_any(errors);
+        return s;
+    }
+
+    // build settings of the lapsa annealer from the same document.
+    // templated so that tante does not depend on lapsa.
+    // the keys mirror lapsa v2.3 (see Makefile) and must be kept in sync
+    // with it: keys lapsa adds later are reported as unknown.
+    // all of them are required
+    template <typename LapsaSettings>
+    LapsaSettings lapsa_settings(const std::string& key_path_prefix) const
+    {
+        const std::string& p = key_path_prefix;
+        std::vector<std::string> errors;
+        std::set<std::string> keys;
+        LapsaSettings s;
+        auto read = [&](const std::string& key, auto& field) {
+            keys.insert(p + "/" + key);
+            _read(p + "/" + key, field, errors, REQUIRED);
+        };
+
+        // clang-format off
+        read("n_states",               s.n_states);
+        read("init_p_acceptance",      s.init_p_acceptance);
+        read("init_t_log_len",         s.init_t_log_len);
+        read("cooling_rate",           s.cooling_rate);
+        read("cooling_round_len",      s.cooling_round_len);
+        read("e_sma_fast_len",         s.e_sma_fast_len);
+        read("e_sma_slow_len",         s.e_sma_slow_len);
+        read("progress_update_period", s.progress_update_period);
+        read("log_filename",           s.log_filename);
+        read("stats_filename",         s.stats_filename);
+        // clang-format on
+        _check_unknown(p, keys, errors);
+
+        _throw_if_any(errors);
+        return s;
+    }
+
+private:
+    static constexpr bool REQUIRED = true;
+    static constexpr bool OPTIONAL = false;
+
+    // value at key_path, or nullptr if it is absent or of a wrong type.
+    // an absent optional key is not an error, the field keeps its default
+    const Json* _find(const std::string& key_path,
+                      Json::Type type,
+                      const std::string& type_name,
+                      std::vector<std::string>& errors,
+                      bool required) const
+    {
+        const Json* j = doc.find(key_path);
+        if (j == nullptr) {
+            if (required) {
+                errors.push_back(key_path + " is missing");
+            }
+            return nullptr;
+        }
+        if (j->type != type) {
+            errors.push_back(key_path + " must be " + type_name);
+            return nullptr;
+        }
+        return j;
+    }
+
+    void _read(const std::string& key_path,
+               size_t& field,
+               std::vector<std::string>& errors,
+               bool required) const
+    {
+        const Json* j =
+                _find(key_path, Json::NUMBER, "a number", errors, required);
+        if (j == nullptr) {
+            return;
+        }
+        if (j->number < 0 || j->number != std::floor(j->number)) {
+            errors.push_back(key_path + " must be a non-negative integer");
+            return;
+        }
+        field = (size_t)j->number;
+    }
+
+    void _read(const std::string& key_path,
+               double& field,
+               std::vector<std::string>& errors,
+               bool required) const
+    {
+        const Json* j =
+                _find(key_path, Json::NUMBER, "a number", errors, required);
+        if (j != nullptr) {
+            field = j->number;
+        }
+    }
+
+    void _read(const std::string& key_path,
+               bool& field,
+               std::vector<std::string>& errors,
+               bool required) const
+    {
+        const Json* j =
+                _find(key_path, Json::BOOL, "a boolean", errors, required);
+        if (j != nullptr) {
+            field = j->boolean;
+        }
+    }
+
+    void _read(const std::string& key_path,
+               std::string& field,
+               std::vector<std::string>& errors,
+               bool required) const
+    {
+        const Json* j =
+                _find(key_path, Json::STRING, "a string", errors, required);
+        if (j != nullptr) {
+            field = j->string;
+        }
+    }
+
+    void _read(const std::string& key_path,
+               Neuron::AFID& field,
+               std::vector<std::string>& errors,
+               bool required) const
+    {
+        const Json* j =
+                _find(key_path, Json::STRING, "a string", errors, required);
+        if (j != nullptr) {
+            _parse_afid(key_path, j->string, true, field, errors);
+        }
+    }
+
+    void _read(const std::string& key_path,
+               std::vector<Neuron::AFID>& field,
+               std::vector<std::string>& errors,
+               bool required) const
+    {
+        const Json* j =
+                _find(key_path, Json::ARRAY, "an array", errors, required);
+        if (j == nullptr) {
+            return;
+        }
+        field.clear();
+        for (const auto& item : j->array) {
+            Neuron::AFID afid = Neuron::AF_RANDOM;
+            if (item.type != Json::STRING) {
+                errors.push_back(key_path + " must contain strings");
+            }
+            else if (_parse_afid(
+                             key_path, item.string, false, afid, errors)) {
+                field.push_back(afid);
+            }
+        }
+    }
+
+    // report every value under key_path that is not one of keys
+    void _check_unknown(const std::string& key_path,
+                        const std::set<std::string>& keys,
+                        std::vector<std::string>& errors) const
+    {
+        const Json* j = doc.find(key_path);
+        if (j == nullptr || j->type != Json::OBJECT) {
+            return;
+        }
+        for (const auto& [name, value] : j->object) {
+            const std::string child_path = key_path + "/" + name;
+            if (keys.contains(child_path)) {
+                continue;
+            }
+            // descend into objects that contain known keys
+            const auto it = keys.lower_bound(child_path + "/");
+            if (value.type == Json::OBJECT && it != keys.end() &&
+                it->starts_with(child_path + "/")) {
+                _check_unknown(child_path, keys, errors);
+                continue;
+            }
+            errors.push_back(child_path + " is not a known key");
+        }
+    }
+
+    static bool _parse_afid(const std::string& key_path,
+                            const std::string& name,
+                            bool allow_random,
+                            Neuron::AFID& afid,
+                            std::vector<std::string>& errors)
+    {
+        if (allow_random && name == "random") {
+            afid = Neuron::AF_RANDOM;
+            return true;
+        }
+        for (int i = 0; i < Neuron::N_AFS; i++) {
+            if (name == Neuron::AF_NAMES[i]) {
+                afid = (Neuron::AFID)i;
+                return true;
+            }
+        }
+        errors.push_back(key_path + ": unknown activation function \"" +
+                         name + "\"");
+        return false;
+    }
+
+    static void _check(bool condition,
+                       const std::string& error,
+                       std::vector<std::string>& errors)
+    {
+        if (!condition) {
+            errors.push_back(error);
+        }
+    }
+
+    void _throw_if_any(const std::vector<std::string>& errors) const
+    {
+        if (errors.empty()) {
+            return;
+        }
+        std::string what = filepath + ": " + std::to_string(errors.size()) +
+                           " configuration error(s):";
+        for (const auto& e : errors) {
+            what += "\n  " + e;
+        }
+        throw std::runtime_error(what);
+    }
+};
+
+inline Settings::Settings(const std::string& config_filepath,
+                          const std::string& key_path_prefix) :
+    Settings(Config(config_filepath).settings(key_path_prefix))
+{
+}
+
+// activation functions used by neurons of a network, as configured in
+// Settings. shared by copies of a network, so it must not change
+class Activations {
+public:
+    std::vector<Neuron::AFID> random_afids;
+
+    Activations(const Settings& settings) :
+        random_afids(settings.random_afids)
+    {
+        assert(!random_afids.empty());
+        for (int i = 0; i < Neuron::N_AFS; i++) {
+            _afs[i] = Neuron::get_af((Neuron::AFID)i);
+        }
+        if (!settings.af_tables) {
+            return;
+        }
+
+        auto table = [&settings](double (*f)(double), double range) {
+            auto t = std::make_shared<const ActivationTable>(
+                    f, range, settings.af_table_len);
+            return [t](double in) { return (*t)(in); };
+        };
+        // sigmoid(x) = (1 + tanh(x / 2)) / 2 saturates at twice the input
+        // of tanh, gaussian exp(-x^2) at about half of it
+        const double range        = settings.af_table_range;
+        _afs[Neuron::AF_TANH]     = table(Neuron::af_tanh, range);
+        _afs[Neuron::AF_SIGMOID]  = table(Neuron::af_sigmoid, 2 * range);
+        _afs[Neuron::AF_GAUSSIAN] = table(Neuron::af_gaussian, range / 2);
+    }
+
+    // resolve AF_RANDOM to one of random_afids
+    Neuron::AFID resolve(Neuron::AFID afid) const
+    {
+        if (afid != Neuron::AF_RANDOM) {
+            return afid;
+        }
+        const size_t i = rododendrs::rnd01() * (double)random_afids.size();
+        return random_afids[std::min(i, random_afids.size() - 1)];
+    }
+
+    const Neuron::ActivationF& get_af(Neuron::AFID afid) const
+    {
+        assert(afid >= 0);
+        assert(afid < Neuron::N_AFS);
+        return _afs[afid];
+    }
+
+private:
+    std::array<Neuron::ActivationF, Neuron::N_AFS> _afs;
+};
+
+inline Neuron::Neuron(AFID in_afid, const Activations& afs) :
+    Vertex(""),
+    afid(afs.resolve(in_afid)),
+    activation_f(afs.get_af(afid))
+{
+}
+
+double rnd_in_range(double min, double max)
+{
+    if (min == max) {
+        return min;
+    }
+
+    assert(min < max);
+    const double retval = (rododendrs::rnd01() * (max - min)) + min;
+    assert(retval >= min);
+    assert(retval <= max);
+    return retval;
+}
+
+// network compiled into flat arrays for fast inference.
+// neurons are grouped into layers by topological depth and stored in
+// consecutive slots. layers that are dense enough are evaluated as a
+// cache-tiled matrix-vector (or matrix-matrix for batches) product,
+// the rest edge by edge.
+// the plan is a snapshot, it must be rebuilt once the network changes.
+class Plan {
+public:
+    // gathered inputs of a dense layer are processed in tiles of up to
+    // SAMPLE_TILE_LEN samples and TILE_LEN / (samples in tile) columns,
+    // so that a tile (16 KiB) stays in l1 cache for every batch size
+    static constexpr size_t TILE_LEN        = 2048;
+    static constexpr size_t SAMPLE_TILE_LEN = 32;
+
+    struct Layer {
+        // neurons of the layer occupy slots [begin, end)
+        size_t begin = 0;
+        size_t end   = 0;
+        bool dense   = false;
+        // dense: distinct source slots, one per matrix column
+        // sparse: source slot of every edge
+        std::vector<size_t> src_slots;
+        // dense: row-major (end - begin) x src_slots.size() matrix
+        // sparse: weight of every edge
+        std::vector<double> weights;
+        // sparse only: edges of neuron begin + i are
+        // [row_begin[i], row_begin[i + 1])
+        std::vector<size_t> row_begin;
+    };
+
+    // buffers reused between calls of infer(), signals are stored
+    // slot-major: signal of slot s for sample b is at s * n_samples + b
+    struct Workspace {
+        std::vector<double> signals;
+        std::vector<double> gathered;
+
+        void fit(const Plan& plan, size_t n_samples)
+        {
+            if (signals.size() < plan.n_slots * n_samples) {
+                signals.resize(plan.n_slots * n_samples);
+            }
+            if (gathered.size() < plan.max_dense_srcs * n_samples) {
+                gathered.resize(plan.max_dense_srcs * n_samples);
+            }
+        }
+    };
+
+    size_t n_slots        = 0;
+    size_t max_dense_srcs = 0;
+    std::vector<size_t> input_slots;
+    std::vector<size_t> output_slots;
+    std::vector<double> biases;
+    std::vector<Neuron::ActivationF> activation_fs;
+    std::vector<Layer> layers;
+
+    Workspace make_workspace(size_t n_samples = 1) const
+    {
+        Workspace ws;
+        ws.fit(*this, n_samples);
+        return ws;
+    }
+
+    void infer(std::span<const double> inputs,
+               std::span<double> outputs,
+               Workspace& ws) const
+    {
+        infer_batch(inputs, outputs, 1, ws);
+    }
+
+    // inputs are n_samples x n_inputs, outputs n_samples x n_outputs,
+    // both sample-major
+    void infer_batch(std::span<const double> inputs,
+                     std::span<double> outputs,
+                     size_t n_samples,
+                     Workspace& ws) const
+    {
+        TRACE_SCOPE("Plan::infer_batch");
+        DEBUG("infering batch...");
+
+        const size_t n_inputs  = input_slots.size();
+        const size_t n_outputs = output_slots.size();
+        assert(inputs.size() == n_samples * n_inputs);
+        assert(outputs.size() == n_samples * n_outputs);
+        ws.fit(*this, n_samples);
+        double* signals = ws.signals.data();
+
+        for (size_t in_i = 0; in_i < n_inputs; in_i++) {
+            double* row = signals + input_slots[in_i] * n_samples;
+            for (size_t b = 0; b < n_samples; b++) {
+                row[b] = inputs[b * n_inputs + in_i];
+            }
+        }
+
+        for (const auto& l : layers) {
+            // start every neuron from its bias
+            for (size_t s = l.begin; s < l.end; s++) {
+                std::fill(signals + s * n_samples,
+                          signals + (s + 1) * n_samples,
+                          biases[s]);
+            }
+
+            if (l.dense) {
+                _accumulate_dense(l, n_samples, ws);
+            }
+            else {
+                _accumulate_sparse(l, n_samples, signals);
+            }
+
+            for (size_t s = l.begin; s < l.end; s++) {
+                double* row = signals + s * n_samples;
+                for (size_t b = 0; b < n_samples; b++) {
+                    row[b] = activation_fs[s](row[b]);
+                }
+            }
+        }
+
+        for (size_t out_i = 0; out_i < n_outputs; out_i++) {
+            const double* row = signals + output_slots[out_i] * n_samples;
+            for (size_t b = 0; b < n_samples; b++) {
+                outputs[b * n_outputs + out_i] = row[b];
+            }
+        }
+    }
+
+private:
+    static void _accumulate_dense(const Layer& l,
+                                  size_t n_samples,
+                                  Workspace& ws)
+    {
+        const size_t n_rows = l.end - l.begin;
+        const size_t n_cols = l.src_slots.size();
+        double* signals     = ws.signals.data();
+        double* x           = ws.gathered.data();
+
+        // gather sources into a contiguous n_cols x n_samples matrix
+        for (size_t k = 0; k < n_cols; k++) {
+            const double* src = signals + l.src_slots[k] * n_samples;
+            std::copy(src, src + n_samples, x + k * n_samples);
+        }
+
+        // y += w * x, tiled over samples and columns
+        double* y             = signals + l.begin * n_samples;
+        const size_t b_tile   = std::min(n_samples, SAMPLE_TILE_LEN);
+        const size_t col_tile = TILE_LEN / b_tile;
+        for (size_t b0 = 0; b0 < n_samples; b0 += b_tile) {
+            const size_t b1 = std::min(b0 + b_tile, n_samples);
+            for (size_t k0 = 0; k0 < n_cols; k0 += col_tile) {
+                const size_t k1 = std::min(k0 + col_tile, n_cols);
+                for (size_t i = 0; i < n_rows; i++) {
+                    const double* w = l.weights.data() + i * n_cols;
+                    double* yi      = y + i * n_samples;
+                    if (n_samples == 1) {
+                        double sum = 0;
+                        for (size_t k = k0; k < k1; k++) {
+                            sum += w[k] * x[k];
+                        }
+                        yi[0] += sum;
+                        continue;
+                    }
+                    for (size_t k = k0; k < k1; k++) {
+                        const double wk  = w[k];
+                        const double* xk = x + k * n_samples;
+                        for (size_t b = b0; b < b1; b++) {
+                            yi[b] += wk * xk[b];
+                        }
+                    }
+                }
+            }
+        }
+    }
+
+    static void _accumulate_sparse(const Layer& l,
+                                   size_t n_samples,
+                                   double* signals)
+    {
+        for (size_t i = 0; i < l.end - l.begin; i++) {
+            double* yi = signals + (l.begin + i) * n_samples;
+            for (size_t e = l.row_begin[i]; e < l.row_begin[i + 1]; e++) {
+                const double w   = l.weights[e];
+                const double* xe = signals + l.src_slots[e] * n_samples;
+                for (size_t b = 0; b < n_samples; b++) {
+                    yi[b] += w * xe[b];
+                }
+            }
+        }
+    }
+};
+
+// copy-on-write value: copies share the same instance until one of them
+// asks for mutable access, which copies the instance if it is shared
+template <typename T>
+class Cow {
+public:
+    Cow() :
+        _p(std::make_shared<T>())
+    {
+    }
+
+    Cow& operator=(T&& value)
+    {
+        _p = std::make_shared<T>(std::move(value));
+        return *this;
+    }
+
+    const T& operator*() const
+    {
+        return *_p;
+    }
+
+    const T* operator->() const
+    {
+        return _p.get();
+    }
+
+    T& mut()
+    {
+        if (_p.use_count() > 1) {
+            _p = std::make_shared<T>(*_p);
+        }
+        return *_p;
+    }
+
+    bool is_shared_with(const Cow& other) const
+    {
+        return _p == other._p;
+    }
+
+private:
+    std::shared_ptr<T> _p;
+};
+
+// copy-on-write array split into chunks of CHUNK_LEN elements: copies
+// share every chunk, writing an element copies only the chunk that holds
+// it if the chunk is shared. the array grows on write, only elements
+// that were written may be read
+template <typename T, size_t CHUNK_LEN = 64>
+class ChunkedCow {
+public:
+    const T& operator[](size_t i) const
+    {
+        assert(i / CHUNK_LEN < _chunks.size());
+        assert(_chunks[i / CHUNK_LEN] != nullptr);
+        return (*_chunks[i / CHUNK_LEN])[i % CHUNK_LEN];
+    }
+
+    T& mut(size_t i)
+    {
+        const size_t chunk_i = i / CHUNK_LEN;
+        if (chunk_i >= _chunks.size()) {
+            _chunks.resize(chunk_i + 1);
+        }
+        auto& chunk = _chunks[chunk_i];
+        if (chunk == nullptr) {
+            chunk = std::make_shared<Chunk>();
+        }
+        else if (chunk.use_count() > 1) {
+            chunk = std::make_shared<Chunk>(*chunk);
+        }
+        return (*chunk)[i % CHUNK_LEN];
+    }
+
+    bool is_shared_with(const ChunkedCow& other, size_t i) const
+    {
+        const size_t chunk_i = i / CHUNK_LEN;
+        return chunk_i < _chunks.size() && chunk_i < other._chunks.size() &&
+               _chunks[chunk_i] == other._chunks[chunk_i];
     }
+
+private:
+    typedef std::array<T, CHUNK_LEN> Chunk;
+    std::vector<std::shared_ptr<Chunk>> _chunks;
 };
 
-class Connection : public grafiins::Edge {
+// fixed set of worker threads that run parallel loops.
+// the calling thread takes part in every loop as well
+class ThreadPool {
 public:
-    double weight;
+    ThreadPool(size_t n_threads = std::thread::hardware_concurrency())
+    {
+        // the calling thread is one of n_threads
+        for (size_t i = 1; i < n_threads; i++) {
+            _workers.emplace_back([this]() { _run_worker(); });
+        }
+    }
 
-    Connection(size_t src_i,
-               size_t dst_i,
-               double weight,
-               std::string label = "") :
-        Edge(src_i, dst_i, label),
-        weight(weight)
+    ~ThreadPool()
     {
+        {
+            std::lock_guard<std::mutex> lock(_m);
+            _stop = true;
+        }
+        _cv_job.notify_all();
+        for (auto& w : _workers) {
+            w.join();
+        }
     }
 
-    Connection() :
-        Connection(0, 0, 0.0)
+    ThreadPool(const ThreadPool&)            = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+
+    size_t n_threads() const
     {
+        return _workers.size() + 1;
     }
-};
 
-struct Settings {
-    size_t n_inputs                     = 1;
-    size_t n_outputs                    = 1;
-    size_t max_n_hidden                 = 10;
-    double min_init_weight              = -10;
-    double max_init_weight              = 10;
-    bool limit_weight                   = false;
-    bool limit_bias                     = false;
-    double min_weight                   = -100;
-    double max_weight                   = 100;
-    double min_bias                     = -100;
-    double max_bias                     = 100;
-    double min_weight_step              = -10;
-    double max_weight_step              = 10;
-    double min_bias_step                = -10;
-    double max_bias_step                = 10;
-    size_t max_op_weight                = 100;
-    size_t op_weights[Operation::N_OPS] = {1};
-    Neuron::AFID neuron_afid            = Neuron::AFID::AF_SIGMOID;
+    // call f(i) for every i in [0, n) and return once all calls are done.
+    // f must be safe to call concurrently and must not throw
+    void parallel_for(size_t n, const std::function<void(size_t)>& f)
+    {
+        {
+            std::lock_guard<std::mutex> lock(_m);
+            _f = &f;
+            _n = n;
+            _next_i.store(0);
+            _n_busy = _workers.size();
+            _job_id++;
+        }
+        _cv_job.notify_all();
 
-    Settings() {}
+        _run_job();
 
-    // clang-format off
-    Settings(const std::string& config_filepath,
-             const std::string& key_path_prefix) :
-        n_inputs        (iestade::size_t_from_json(config_filepath, key_path_prefix + "/n_inputs")),
-        n_outputs       (iestade::size_t_from_json(config_filepath, key_path_prefix + "/n_outputs")),
-        max_n_hidden    (iestade::size_t_from_json(config_filepath, key_path_prefix + "/max_n_hidden")),
-        min_init_weight (iestade::double_from_json(config_filepath, key_path_prefix + "/min_init_weight")),
-        max_init_weight (iestade::double_from_json(config_filepath, key_path_prefix + "/max_init_weight")),
-        limit_weight    (iestade::bool_from_json  (config_filepath, key_path_prefix + "/limit_weight")),
-        limit_bias      (iestade::bool_from_json  (config_filepath, key_path_prefix + "/limit_bias")),
-        min_weight      (iestade::double_from_json(config_filepath, key_path_prefix + "/min_weight")),
-        max_weight      (iestade::double_from_json(config_filepath, key_path_prefix + "/max_weight")),
-        min_bias        (iestade::double_from_json(config_filepath, key_path_prefix + "/min_bias")),
-        max_bias        (iestade::double_from_json(config_filepath, key_path_prefix + "/max_bias")),
-        min_weight_step (iestade::double_from_json(config_filepath, key_path_prefix + "/min_weight_step")),
-        max_weight_step (iestade::double_from_json(config_filepath, key_path_prefix + "/max_weight_step")),
-        min_bias_step   (iestade::double_from_json(config_filepath, key_path_prefix + "/min_bias_step")),
-        max_bias_step   (iestade::double_from_json(config_filepath, key_path_prefix + "/max_bias_step")),
-        max_op_weight   (iestade::size_t_from_json(config_filepath, key_path_prefix + "/max_op_weight"))
-    {
-        op_weights[Operation::ADD_INPUT]        = iestade::size_t_from_json(config_filepath, key_path_prefix + "/op_weights/add_input");
-        op_weights[Operation::RM_INPUT]         = iestade::size_t_from_json(config_filepath, key_path_prefix + "/op_weights/rm_input");
-        op_weights[Operation::ADD_OUTPUT]       = iestade::size_t_from_json(config_filepath, key_path_prefix + "/op_weights/add_output");
-        op_weights[Operation::RM_OUTPUT]        = iestade::size_t_from_json(config_filepath, key_path_prefix + "/op_weights/rm_output");
-        op_weights[Operation::ADD_HIDDEN]       = iestade::size_t_from_json(config_filepath, key_path_prefix + "/op_weights/add_hidden");
-        op_weights[Operation::RM_HIDDEN]        = iestade::size_t_from_json(config_filepath, key_path_prefix + "/op_weights/rm_hidden");
-        op_weights[Operation::ADD_CONNECTION]   = iestade::size_t_from_json(config_filepath, key_path_prefix + "/op_weights/add_connection");
-        op_weights[Operation::RM_CONNECTION]    = iestade::size_t_from_json(config_filepath, key_path_prefix + "/op_weights/rm_connection");
-        op_weights[Operation::STEP_WEIGHT]      = iestade::size_t_from_json(config_filepath, key_path_prefix + "/op_weights/step_weight");
-        op_weights[Operation::STEP_BIAS]        = iestade::size_t_from_json(config_filepath, key_path_prefix + "/op_weights/step_bias");
-        op_weights[Operation::RND_WEIGHT]       = iestade::size_t_from_json(config_filepath, key_path_prefix + "/op_weights/rnd_weight");
-        op_weights[Operation::RND_BIAS]         = iestade::size_t_from_json(config_filepath, key_path_prefix + "/op_weights/rnd_bias");
-    }
-    // clang-format on
-};
+        std::unique_lock<std::mutex> lock(_m);
+        _cv_done.wait(lock, [this]() { return _n_busy == 0; });
+        _f = nullptr;
+    }
 
-double rnd_in_range(double min, double max)
-{
-    if (min == max) {
-        return min;
+private:
+    std::vector<std::thread> _workers;
+    std::mutex _m;
+    std::condition_variable _cv_job;
+    std::condition_variable _cv_done;
+    const std::function<void(size_t)>* _f = nullptr;
+    size_t _n                             = 0;
+    std::atomic<size_t> _next_i           = 0;
+    size_t _n_busy                        = 0;
+    size_t _job_id                        = 0;
+    bool _stop                            = false;
+
+    void _run_job()
+    {
+        size_t i = 0;
+        while ((i = _next_i.fetch_add(1)) < _n) {
+            (*_f)(i);
+        }
     }
 
-    assert(min < max);
-    const double retval = (rododendrs::rnd01() * (max - min)) + min;
-    assert(retval >= min);
-    assert(retval <= max);
-    return retval;
-}
+    void _run_worker()
+    {
+        size_t done_job_id = 0;
+        while (true) {
+            {
+                std::unique_lock<std::mutex> lock(_m);
+                _cv_job.wait(lock, [this, done_job_id]() {
+                    return _stop || _job_id != done_job_id;
+                });
+                if (_stop) {
+                    return;
+                }
+                done_job_id = _job_id;
+            }
+
+            _run_job();
+
+            std::lock_guard<std::mutex> lock(_m);
+            _n_busy--;
+            if (_n_busy == 0) {
+                _cv_done.notify_one();
+            }
+        }
+    }
+};
+
+// how change_to_neighbour() picks one of the proposals
+enum Selection {
+    SELECT_BEST = 0,
+    SELECT_BOLTZMANN,
+};
 
 class Network {
 public:
-    Settings settings;
+    // buffers reused between calls of infer(), indexed by vertex index.
+    // a vertex signal is valid if its calculated_at equals generation,
+    // which avoids clearing the buffers on every call
+    struct Workspace {
+        std::vector<double> signals;
+        std::vector<size_t> calculated_at;
+        size_t generation = 0;
+
+        void fit(size_t vi)
+        {
+            if (vi >= signals.size()) {
+                signals.resize(vi + 1, 0);
+                calculated_at.resize(vi + 1, 0);
+            }
+        }
+    };
 
     Network(Settings& in_settings) :
-        settings(in_settings)
+        _settings(std::make_shared<const Settings>(in_settings)),
+        _afs(std::make_shared<const Activations>(*_settings))
     {
-        assert(settings.n_inputs > 0);
-        assert(settings.n_outputs > 0);
-        assert(settings.max_n_hidden > 0);
-        assert(settings.max_op_weight > 0);
+        assert(_settings->n_inputs > 0);
+        assert(_settings->n_outputs > 0);
+        assert(_settings->max_n_hidden > 0);
+        assert(_settings->max_op_weight > 0);
 #ifndef NDEBUG
-        for (auto w : settings.op_weights) {
-            assert(w <= settings.max_op_weight);
+        for (auto w : _settings->op_weights) {
+            assert(w <= _settings->max_op_weight);
         }
 #endif
-        assert(settings.min_init_weight <= settings.max_init_weight);
-        assert(settings.min_weight_step <= settings.max_weight_step);
-        assert(settings.min_bias_step <= settings.max_bias_step);
+        assert(_settings->min_init_weight <= _settings->max_init_weight);
+        assert(_settings->min_weight_step <= _settings->max_weight_step);
+        assert(_settings->min_bias_step <= _settings->max_bias_step);
+    }
+
+    const Settings& settings() const
+    {
+        return *_settings;
     }
 
     bool is_operational()
     {
+        TRACE_SCOPE("is_operational");
         DEBUG("checking if operational...");
 
-        assert(_inputs_i.size() <= settings.n_inputs);
-        assert(_outputs_i.size() <= settings.n_outputs);
-        assert(_hidden_i.size() <= settings.max_n_hidden);
+        assert(_inputs_i->size() <= _settings->n_inputs);
+        assert(_outputs_i->size() <= _settings->n_outputs);
+        assert(_hidden_i->size() <= _settings->max_n_hidden);
 
-        if (_inputs_i.empty()) {
+        if (_inputs_i->empty()) {
             DEBUG("no inputs.");
             return false;
         }
 
-        if (_outputs_i.empty()) {
+        if (_outputs_i->empty()) {
             DEBUG("no outputs.");
             return false;
         }
 
-        const std::list<size_t> list_inputs_vi  = _inputs_i.list();
-        const std::list<size_t> list_outputs_vi = _outputs_i.list();
+        const std::list<size_t> list_inputs_vi  = _inputs_i->list();
+        const std::list<size_t> list_outputs_vi = _outputs_i->list();
         const std::set<size_t> set_inputs_vi{list_inputs_vi.begin(),
                                              list_inputs_vi.end()};
         const std::set<size_t> set_outputs_vi{list_outputs_vi.begin(),
@@ -240,7 +1644,7 @@ public:
 
         // every input has a connection to at least one output
         for (size_t ivi : list_inputs_vi) {
-            if (!_g.are_connected_any({ivi}, set_outputs_vi)) {
+            if (!_g->are_connected_any({ivi}, set_outputs_vi)) {
                 DEBUG("disconnected input found.");
                 return false;
             }
@@ -248,7 +1652,7 @@ public:
 
         // every output has a connection to at least one input
         for (size_t ovi : list_outputs_vi) {
-            if (!_g.are_connected_any(set_inputs_vi, {ovi})) {
+            if (!_g->are_connected_any(set_inputs_vi, {ovi})) {
                 DEBUG("disconnected output found.");
                 return false;
             }
@@ -260,19 +1664,21 @@ public:
     // keep applying random operations until the network becomes operational
     void restore_randomly()
     {
+        TRACE_SCOPE("restore_randomly");
+
         // add missing inputs
-        const size_t add_n_inputs = settings.n_inputs - _inputs_i.size();
+        const size_t add_n_inputs = _settings->n_inputs - _inputs_i->size();
         for (size_t i = 0; i < add_n_inputs; i++) {
             _add_input();
         }
-        assert(_inputs_i.size() == settings.n_inputs);
+        assert(_inputs_i->size() == _settings->n_inputs);
 
         // add missing outputs
-        const size_t add_n_outputs = settings.n_outputs - _outputs_i.size();
+        const size_t add_n_outputs = _settings->n_outputs - _outputs_i->size();
         for (size_t i = 0; i < add_n_outputs; i++) {
             _add_output();
         }
-        assert(_outputs_i.size() == settings.n_outputs);
+        assert(_outputs_i->size() == _settings->n_outputs);
 
         // add connections and hidden neurons until the network is restored
         while (!is_operational()) {
@@ -290,6 +1696,209 @@ public:
             while (!apply_operation(get_random_operation(allowed_ops))) {};
         }
         DEBUG("is operational");
+
+        if (fragmentation() > _settings->max_fragmentation) {
+            compact();
+        }
+    }
+
+    // return a value in [0, 1] describing how scattered the vertex and
+    // edge indices are: the largest of
+    // - share of unused vertex indices below the highest used one
+    // - share of unused edge indices below the highest used one
+    // - share of edges that point from a higher to a lower vertex index
+    double fragmentation() const
+    {
+        const std::vector<size_t> vis = _vertices_i();
+        if (vis.empty()) {
+            return 0;
+        }
+
+        size_t max_vi     = 0;
+        size_t max_ei     = 0;
+        size_t n_edges    = 0;
+        size_t n_backward = 0;
+        for (size_t vi : vis) {
+            max_vi        = std::max(max_vi, vi);
+            const auto* v = _g->vertex_at(vi);
+            assert(v != nullptr);
+            for (size_t ei : v->_in_edges_i) {
+                const auto* e = _g->edge_at(ei);
+                assert(e != nullptr);
+                assert(e->_src_vertex_i.has_value());
+                max_ei = std::max(max_ei, ei);
+                n_edges++;
+                if (e->_src_vertex_i.value() > vi) {
+                    n_backward++;
+                }
+            }
+        }
+
+        double retval = 1.0 - (double)vis.size() / (double)(max_vi + 1);
+        if (n_edges > 0) {
+            retval = std::max(retval,
+                              1.0 - (double)n_edges / (double)(max_ei + 1));
+            retval = std::max(retval, (double)n_backward / (double)n_edges);
+        }
+        assert(retval >= 0);
+        assert(retval <= 1);
+        return retval;
+    }
+
+    // rebuild the graph so that vertices are numbered in topological order
+    // (inputs first) and edges are numbered by destination, then source.
+    // role lists are renumbered accordingly, preserving their order.
+    // signals of the network are not affected.
+    void compact()
+    {
+        TRACE_SCOPE("compact");
+        DEBUG("compacting...");
+
+        // find topological order
+        std::vector<size_t> order;
+        std::set<size_t> visited_i;
+        for (size_t vi : _vertices_i()) {
+            _dfs_topological_order(vi, visited_i, order);
+        }
+        assert(order.size() == _g->n_vertices());
+
+        // add vertices in topological order
+        grafiins::DAG<Neuron, Connection> g;
+        ChunkedCow<double> biases;
+        std::map<size_t, size_t> new_vi;
+        for (size_t vi : order) {
+            const auto* v = _g->vertex_at(vi);
+            assert(v != nullptr);
+            const size_t new_i = g.add_vertex(Neuron(v->afid, *_afs));
+            biases.mut(new_i)  = _biases[vi];
+            new_vi[vi]         = new_i;
+        }
+
+        // add edges ordered by destination, then source
+        std::vector<std::pair<Connection, double>> connections;
+        for (size_t vi : order) {
+            for (size_t ei : _g->vertex_at(vi)->_in_edges_i) {
+                const auto* e = _g->edge_at(ei);
+                assert(e != nullptr);
+                assert(e->_src_vertex_i.has_value());
+                connections.push_back(
+                        {Connection(new_vi.at(e->_src_vertex_i.value()),
+                                    new_vi.at(vi)),
+                         _weights[ei]});
+            }
+        }
+        std::sort(connections.begin(),
+                  connections.end(),
+                  [](const auto& a, const auto& b) {
+                      return std::make_pair(a.first._dst_vertex_i.value(),
+                                            a.first._src_vertex_i.value()) <
+                             std::make_pair(b.first._dst_vertex_i.value(),
+                                            b.first._src_vertex_i.value());
+                  });
+        ChunkedCow<double> weights;
+        for (auto& [c, weight] : connections) {
+            const std::optional<size_t> ei = g.add_edge(c);
+            assert(ei.has_value());
+            weights.mut(ei.value()) = weight;
+        }
+        assert(g.n_edges() == _g->n_edges());
+
+        // remap roles
+        auto remap = [&new_vi](const garaza::Storage<size_t>& roles) {
+            garaza::Storage<size_t> retval;
+            for (size_t vi : roles.list()) {
+                retval.add(new_vi.at(vi));
+            }
+            return retval;
+        };
+        _inputs_i  = remap(*_inputs_i);
+        _outputs_i = remap(*_outputs_i);
+        _hidden_i  = remap(*_hidden_i);
+        _g         = std::move(g);
+        _biases    = std::move(biases);
+        _weights   = std::move(weights);
+    }
+
+    // cheap copy: settings, graph, role lists and chunks of weights and
+    // biases are shared with this network until either side changes them,
+    // and only the changed one is then copied. changing a weight or a bias
+    // copies a single chunk, adding or removing a neuron or a connection
+    // copies the graph
+    Network snapshot() const
+    {
+        return *this;
+    }
+
+    // apply a random operation and restore the network
+    void change()
+    {
+        TRACE_SCOPE("change");
+
+        while (!apply_operation(get_random_operation())) {};
+        restore_randomly();
+    }
+
+    // explore several neighbours within a single annealing step:
+    // - create n_proposals copies of the network and change() each of them
+    // - score the copies in parallel with energy_f(Network&) -> double
+    // - replace the network with the copy of the lowest energy, or,
+    //   with SELECT_BOLTZMANN, pick a copy with probability proportional
+    //   to exp(-(energy - min_energy) / temperature)
+    // return energy of the selected copy, so the caller does not have to
+    // score it again.
+    // SELECT_BEST always proposes the greedy best of n_proposals, which
+    // skews the energy changes an annealer sees downhill and changes its
+    // convergence. an annealer should use SELECT_BOLTZMANN with its own
+    // current temperature, which the network does not know. lapsa does
+    // not hand the temperature to State::change(), so its states keep
+    // proposing a single neighbour with change()
+    // mutations run on the calling thread, so energy_f is the only code
+    // that has to be thread safe
+    template <typename EnergyF>
+    double change_to_neighbour(size_t n_proposals,
+                               EnergyF energy_f,
+                               ThreadPool& pool,
+                               Selection selection = SELECT_BEST,
+                               double temperature  = 0)
+    {
+        TRACE_SCOPE("change_to_neighbour");
+        DEBUG("proposing neighbours...");
+
+        assert(n_proposals > 0);
+        std::vector<Network> proposals;
+        proposals.reserve(n_proposals);
+        for (size_t i = 0; i < n_proposals; i++) {
+            proposals.push_back(snapshot());
+            proposals.back().change();
+        }
+
+        std::vector<double> energies(n_proposals);
+        pool.parallel_for(n_proposals, [&](size_t i) {
+            TRACE_SCOPE("energy");
+            energies[i] = energy_f(proposals[i]);
+        });
+
+        const size_t best_i =
+                std::min_element(energies.begin(), energies.end()) -
+                energies.begin();
+        size_t selected_i = best_i;
+        if (selection == SELECT_BOLTZMANN && temperature > 0) {
+            std::vector<double> cumulative_p(n_proposals);
+            double sum_p = 0;
+            for (size_t i = 0; i < n_proposals; i++) {
+                sum_p += std::exp(-(energies[i] - energies[best_i]) /
+                                  temperature);
+                cumulative_p[i] = sum_p;
+            }
+            const double rnd_p = rododendrs::rnd01() * sum_p;
+            const auto it      = std::upper_bound(
+                    cumulative_p.begin(), cumulative_p.end(), rnd_p);
+            selected_i = std::min((size_t)(it - cumulative_p.begin()),
+                                  n_proposals - 1);
+        }
+
+        *this = std::move(proposals[selected_i]);
+        return energies[selected_i];
     }
 
     // return random operation from the provided list, based on
@@ -303,7 +1912,7 @@ public:
         for (auto& op : ops) {
             assert(op != Operation::N_OPS);
             assert(op < Operation::N_OPS);
-            op_weights_sum += settings.op_weights[op];
+            op_weights_sum += _settings->op_weights[op];
             op_value[op] = op_weights_sum;
         }
 
@@ -334,68 +1943,69 @@ public:
 
     bool apply_operation(Operation op)
     {
+        TRACE_SCOPE("apply_operation");
         DEBUG("applying operation...");
 
         switch (op) {
             case Operation::ADD_INPUT:
                 return _add_input().has_value();
             case Operation::RM_INPUT:
-                if (_inputs_i.empty()) {
+                if (_inputs_i->empty()) {
                     return false;
                 }
-                _rm_input(_inputs_i.rnd_i());
+                _rm_input(_inputs_i->rnd_i());
                 return true;
             case Operation::ADD_OUTPUT:
                 return _add_output().has_value();
             case Operation::RM_OUTPUT:
-                if (_outputs_i.empty()) {
+                if (_outputs_i->empty()) {
                     return false;
                 }
-                _rm_output(_outputs_i.rnd_i());
+                _rm_output(_outputs_i->rnd_i());
                 return true;
             case Operation::ADD_HIDDEN:
                 return _add_hidden().has_value();
             case Operation::RM_HIDDEN:
-                if (_hidden_i.empty()) {
+                if (_hidden_i->empty()) {
                     return false;
                 }
-                _rm_hidden(_hidden_i.rnd_i());
+                _rm_hidden(_hidden_i->rnd_i());
                 return true;
             case Operation::ADD_CONNECTION:
-                if (_g.n_vertices() < 2) {
+                if (_g->n_vertices() < 2) {
                     return false;
                 }
-                return _add_connection(_g.rnd_vertex_i(), _g.rnd_vertex_i())
+                return _add_connection(_g->rnd_vertex_i(), _g->rnd_vertex_i())
                         .has_value();
             case Operation::RM_CONNECTION:
-                if (_g.n_edges() == 0) {
+                if (_g->n_edges() == 0) {
                     return false;
                 }
-                _rm_connection(_g.rnd_edge_i());
+                _rm_connection(_g->rnd_edge_i());
                 return true;
             case Operation::STEP_WEIGHT:
-                if (_g.n_edges() == 0) {
+                if (_g->n_edges() == 0) {
                     return false;
                 }
-                _step_weight(_g.rnd_edge_i());
+                _step_weight(_g->rnd_edge_i());
                 return true;
             case Operation::STEP_BIAS:
-                if (_g.n_vertices() == 0) {
+                if (_g->n_vertices() == 0) {
                     return false;
                 }
-                _step_bias(_g.rnd_vertex_i());
+                _step_bias(_g->rnd_vertex_i());
                 return true;
             case Operation::RND_WEIGHT:
-                if (_g.n_edges() == 0) {
+                if (_g->n_edges() == 0) {
                     return false;
                 }
-                _rnd_weight(_g.rnd_edge_i());
+                _rnd_weight(_g->rnd_edge_i());
                 return true;
             case Operation::RND_BIAS:
-                if (_g.n_vertices() == 0) {
+                if (_g->n_vertices() == 0) {
                     return false;
                 }
-                _rnd_bias(_g.rnd_vertex_i());
+                _rnd_bias(_g->rnd_vertex_i());
                 return true;
 
             case Operation::N_OPS:
@@ -412,37 +2022,308 @@ public:
 
     std::vector<double> infer(const std::vector<double> inputs)
     {
+        std::vector<double> outputs(_outputs_i->size());
+        Workspace ws;
+        infer(inputs, outputs, ws);
+        return outputs;
+    }
+
+    // allocation-free inference: once the workspace has grown to fit
+    // the network, no heap allocations are performed
+    void infer(std::span<const double> inputs,
+               std::span<double> outputs,
+               Workspace& ws)
+    {
+        TRACE_SCOPE("infer");
         DEBUG("infering...");
 
-        std::set<size_t> calculated_i;
-        std::map<size_t, double> signals;
+        // invalidate signals of the previous inference
+        ws.generation++;
 
         // set input signals
-        assert(inputs.size() == _inputs_i.size());
-        for (size_t in_i = 0; in_i < _inputs_i.size(); in_i++) {
-            const size_t vi = *_inputs_i.at(in_i);
-            assert(!calculated_i.contains(vi));
-            calculated_i.insert(vi);
-            signals[vi] = inputs[in_i];
+        assert(inputs.size() == _inputs_i->size());
+        for (size_t in_i = 0; in_i < _inputs_i->size(); in_i++) {
+            const size_t vi = *_inputs_i->at(in_i);
+            ws.fit(vi);
+            assert(ws.calculated_at[vi] != ws.generation);
+            ws.calculated_at[vi] = ws.generation;
+            ws.signals[vi]       = inputs[in_i];
         }
 
         // calculate signal for every output
-        std::vector<double> output_signals;
-        for (size_t out_i = 0; out_i < _outputs_i.size(); out_i++) {
-            output_signals.push_back(dfs_calculate_signal(
-                    *_outputs_i.at(out_i), calculated_i, signals));
+        assert(outputs.size() == _outputs_i->size());
+        for (size_t out_i = 0; out_i < _outputs_i->size(); out_i++) {
+            outputs[out_i] = dfs_calculate_signal(*_outputs_i->at(out_i), ws);
+        }
+    }
+
+    // return workspace large enough to infer without allocations
+    Workspace make_workspace() const
+    {
+        Workspace ws;
+        for (size_t vi : _vertices_i()) {
+            ws.fit(vi);
+        }
+        return ws;
+    }
+
+    // write the network in a plain text format:
+    //   tante_network 1
+    //   vertices <n>
+    //   <role: i, o or h> <afid> <bias>     (n lines)
+    //   edges <m>
+    //   <src vertex> <dst vertex> <weight>  (m lines)
+    // vertices are numbered by their position in the file
+    void save(std::ostream& os) const
+    {
+        const std::vector<size_t> vis = _vertices_i();
+        std::map<size_t, size_t> file_vi;
+        const auto precision = os.precision();
+        os.precision(std::numeric_limits<double>::max_digits10);
+
+        os << "tante_network 1\n";
+        os << "vertices " << vis.size() << "\n";
+        size_t n_edges = 0;
+        for (size_t vi : vis) {
+            const auto* v = _g->vertex_at(vi);
+            assert(v != nullptr);
+            const char role = _inputs_i->contains(vi)    ? 'i'
+                              : _outputs_i->contains(vi) ? 'o'
+                                                        : 'h';
+            os << role << " " << v->afid << " " << _biases[vi] << "\n";
+            file_vi[vi] = file_vi.size();
+            n_edges += v->_in_edges_i.size();
         }
 
-        return output_signals;
+        os << "edges " << n_edges << "\n";
+        for (size_t vi : vis) {
+            for (size_t ei : _g->vertex_at(vi)->_in_edges_i) {
+                const auto* e = _g->edge_at(ei);
+                assert(e != nullptr);
+                os << file_vi.at(e->_src_vertex_i.value()) << " "
+                   << file_vi.at(vi) << " " << _weights[ei] << "\n";
+            }
+        }
+        os.precision(precision);
+    }
+
+    // replace the network with one written by save().
+    // throws std::runtime_error if the input is malformed or does not fit
+    // the settings
+    void load(std::istream& is)
+    {
+        auto fail = [](const std::string& what) {
+            throw std::runtime_error("failed to load network: " + what);
+        };
+
+        std::string token;
+        size_t version = 0;
+        if (!(is >> token >> version) || token != "tante_network" ||
+            version != 1) {
+            fail("unsupported format");
+        }
+
+        grafiins::DAG<Neuron, Connection> g;
+        garaza::Storage<size_t> inputs_i;
+        garaza::Storage<size_t> outputs_i;
+        garaza::Storage<size_t> hidden_i;
+        ChunkedCow<double> biases;
+        ChunkedCow<double> weights;
+        std::vector<size_t> vis;
+
+        size_t n_vertices = 0;
+        if (!(is >> token >> n_vertices) || token != "vertices") {
+            fail("vertices expected");
+        }
+        for (size_t i = 0; i < n_vertices; i++) {
+            char role   = 0;
+            int afid    = 0;
+            double bias = 0;
+            if (!(is >> role >> afid >> bias)) {
+                fail("vertex " + std::to_string(i) + " is malformed");
+            }
+            if (afid < 0 || afid >= Neuron::N_AFS) {
+                fail("vertex " + std::to_string(i) + " has unknown afid");
+            }
+            const size_t vi =
+                    g.add_vertex(Neuron((Neuron::AFID)afid, *_afs));
+            vis.push_back(vi);
+            biases.mut(vi) = bias;
+            switch (role) {
+                case 'i':
+                    inputs_i.add(vi);
+                    break;
+                case 'o':
+                    outputs_i.add(vi);
+                    break;
+                case 'h':
+                    hidden_i.add(vi);
+                    break;
+                default:
+                    fail("vertex " + std::to_string(i) + " has unknown role");
+            }
+        }
+        // inputs and outputs define the width of infer(), so they have to
+        // match the settings exactly
+        if (inputs_i.size() != _settings->n_inputs ||
+            outputs_i.size() != _settings->n_outputs) {
+            fail("number of inputs or outputs does not match the settings");
+        }
+        if (hidden_i.size() > _settings->max_n_hidden) {
+            fail("too many hidden neurons for the settings");
+        }
+
+        size_t n_edges = 0;
+        if (!(is >> token >> n_edges) || token != "edges") {
+            fail("edges expected");
+        }
+        for (size_t i = 0; i < n_edges; i++) {
+            size_t src    = 0;
+            size_t dst    = 0;
+            double weight = 0;
+            if (!(is >> src >> dst >> weight) || src >= vis.size() ||
+                dst >= vis.size()) {
+                fail("edge " + std::to_string(i) + " is malformed");
+            }
+            // the same restrictions as in _add_connection()
+            if (outputs_i.contains(vis[src]) || inputs_i.contains(vis[dst]) ||
+                src == dst) {
+                fail("edge " + std::to_string(i) + " is not allowed");
+            }
+            const std::optional<size_t> ei =
+                    g.add_edge(Connection(vis[src], vis[dst]));
+            if (!ei.has_value()) {
+                fail("edge " + std::to_string(i) + " is not allowed");
+            }
+            weights.mut(ei.value()) = weight;
+        }
+
+        _g         = std::move(g);
+        _inputs_i  = std::move(inputs_i);
+        _outputs_i = std::move(outputs_i);
+        _hidden_i  = std::move(hidden_i);
+        _biases    = std::move(biases);
+        _weights   = std::move(weights);
+    }
+
+    // compile the current network into a Plan, see Plan.
+    // only neurons that contribute to outputs are included
+    Plan compile() const
+    {
+        TRACE_SCOPE("compile");
+        DEBUG("compiling...");
+
+        // ancestors of outputs in topological order
+        std::vector<size_t> order;
+        std::set<size_t> visited_i;
+        for (size_t vi : _outputs_i->list()) {
+            _dfs_topological_order(vi, visited_i, order);
+        }
+
+        // group by depth, inputs are kept separately
+        std::map<size_t, size_t> depth;
+        std::vector<std::vector<size_t>> layers_vi;
+        for (size_t vi : order) {
+            if (_inputs_i->contains(vi)) {
+                depth[vi] = 0;
+                continue;
+            }
+            size_t d = 0;
+            for (size_t ei : _g->vertex_at(vi)->_in_edges_i) {
+                d = std::max(d,
+                             depth.at(_g->edge_at(ei)->_src_vertex_i.value()) +
+                                     1);
+            }
+            depth[vi] = d;
+            if (layers_vi.size() <= d) {
+                layers_vi.resize(d + 1);
+            }
+            layers_vi[d].push_back(vi);
+        }
+
+        // assign slots: inputs first, then layer by layer
+        Plan p;
+        std::map<size_t, size_t> slot;
+        auto add_slot = [&](size_t vi, double bias, Neuron::ActivationF af) {
+            slot[vi] = p.n_slots++;
+            p.biases.push_back(bias);
+            p.activation_fs.push_back(af);
+        };
+        for (size_t vi : _inputs_i->list()) {
+            add_slot(vi, 0, Neuron::ActivationF());
+            p.input_slots.push_back(slot.at(vi));
+        }
+        for (const auto& layer_vi : layers_vi) {
+            for (size_t vi : layer_vi) {
+                add_slot(vi, _biases[vi], _g->vertex_at(vi)->activation_f);
+            }
+        }
+        for (size_t vi : _outputs_i->list()) {
+            p.output_slots.push_back(slot.at(vi));
+        }
+
+        for (const auto& layer_vi : layers_vi) {
+            if (layer_vi.empty()) {
+                continue;
+            }
+            Plan::Layer l;
+            l.begin = slot.at(layer_vi.front());
+            l.end   = l.begin + layer_vi.size();
+
+            // collect distinct sources and the edge count
+            std::map<size_t, size_t> col;
+            size_t n_edges = 0;
+            for (size_t vi : layer_vi) {
+                for (size_t ei : _g->vertex_at(vi)->_in_edges_i) {
+                    col[slot.at(_g->edge_at(ei)->_src_vertex_i.value())] = 0;
+                    n_edges++;
+                }
+            }
+            const double n_cells = (double)layer_vi.size() * col.size();
+            const double density = (n_edges > 0) ? n_edges / n_cells : 0;
+
+            l.dense = n_edges > 0 && density >= _settings->min_dense_density;
+
+            if (l.dense) {
+                for (auto& [src_slot, k] : col) {
+                    k = l.src_slots.size();
+                    l.src_slots.push_back(src_slot);
+                }
+                l.weights.resize(layer_vi.size() * col.size(), 0);
+                for (size_t i = 0; i < layer_vi.size(); i++) {
+                    for (size_t ei : _g->vertex_at(layer_vi[i])->_in_edges_i) {
+                        const auto* e = _g->edge_at(ei);
+                        const size_t k =
+                                col.at(slot.at(e->_src_vertex_i.value()));
+                        l.weights[i * col.size() + k] += _weights[ei];
+                    }
+                }
+                p.max_dense_srcs = std::max(p.max_dense_srcs, col.size());
+            }
+            else {
+                l.row_begin.push_back(0);
+                for (size_t vi : layer_vi) {
+                    for (size_t ei : _g->vertex_at(vi)->_in_edges_i) {
+                        const auto* e = _g->edge_at(ei);
+                        l.src_slots.push_back(
+                                slot.at(e->_src_vertex_i.value()));
+                        l.weights.push_back(_weights[ei]);
+                    }
+                    l.row_begin.push_back(l.src_slots.size());
+                }
+            }
+            p.layers.push_back(l);
+        }
+
+        return p;
     }
 
     // depth first search function that calculates signals of neurons
-    double dfs_calculate_signal(size_t vertex_i,
-                                std::set<size_t>& calculated_i,
-                                std::map<size_t, double>& signals)
+    double dfs_calculate_signal(size_t vertex_i, Workspace& ws)
     {
-        if (calculated_i.contains(vertex_i)) {
-            return signals[vertex_i];
+        ws.fit(vertex_i);
+        if (ws.calculated_at[vertex_i] == ws.generation) {
+            return ws.signals[vertex_i];
         }
 
         // - get Neuron = vi, bias
@@ -454,45 +2335,88 @@ public:
         //   - get signal(src_vi)
         //   - update sum
         // - apply acceptance_f(sum)
-        const auto* v = _g.vertex_at(vertex_i);
+        const auto* v = _g->vertex_at(vertex_i);
         assert(v != nullptr);
-        double sum                        = v->bias;
-        const std::set<size_t> in_edges_i = v->_in_edges_i;
-        for (size_t ei : in_edges_i) {
-            const auto* e = _g.edge_at(ei);
+        double sum = _biases[vertex_i];
+        for (size_t ei : v->_in_edges_i) {
+            const auto* e = _g->edge_at(ei);
             assert(e != nullptr);
             assert(e->_src_vertex_i.has_value());
-            const size_t src_vi = e->_src_vertex_i.value();
             const double signal =
-                    dfs_calculate_signal(src_vi, calculated_i, signals);
-            signals[src_vi]     = signal;
-            const double weight = e->weight;
-            sum += weight * signal;
+                    dfs_calculate_signal(e->_src_vertex_i.value(), ws);
+            sum += _weights[ei] * signal;
         }
 
-        calculated_i.insert(vertex_i);
-        return v->activation_f(sum);
+        const double signal        = v->activation_f(sum);
+        ws.calculated_at[vertex_i] = ws.generation;
+        ws.signals[vertex_i]       = signal;
+        return signal;
     }
 
 private:
-    grafiins::DAG<Neuron, Connection> _g;
-    garaza::Storage<size_t> _inputs_i;
-    garaza::Storage<size_t> _outputs_i;
-    garaza::Storage<size_t> _hidden_i;
-    // connections are stored within _g
+    // settings and activation functions never change after construction,
+    // copies of a network share them
+    std::shared_ptr<const Settings> _settings;
+    std::shared_ptr<const Activations> _afs;
+    // copies of a network share these until one of them changes,
+    // see Cow
+    Cow<grafiins::DAG<Neuron, Connection>> _g;
+    Cow<garaza::Storage<size_t>> _inputs_i;
+    Cow<garaza::Storage<size_t>> _outputs_i;
+    Cow<garaza::Storage<size_t>> _hidden_i;
+    // biases indexed by vertex index and weights indexed by edge index.
+    // kept outside of _g, so that changing one copies a chunk instead of
+    // the whole graph
+    ChunkedCow<double> _biases;
+    ChunkedCow<double> _weights;
+
+    // every vertex has exactly one role, so together the role lists
+    // enumerate all vertices of _g
+    std::vector<size_t> _vertices_i() const
+    {
+        std::vector<size_t> retval;
+        for (const auto* roles : {&*_inputs_i, &*_hidden_i, &*_outputs_i}) {
+            for (size_t vi : roles->list()) {
+                retval.push_back(vi);
+            }
+        }
+        return retval;
+    }
+
+    void _dfs_topological_order(size_t vertex_i,
+                                std::set<size_t>& visited_i,
+                                std::vector<size_t>& order) const
+    {
+        if (visited_i.contains(vertex_i)) {
+            return;
+        }
+        visited_i.insert(vertex_i);
+
+        const auto* v = _g->vertex_at(vertex_i);
+        assert(v != nullptr);
+        for (size_t ei : v->_in_edges_i) {
+            const auto* e = _g->edge_at(ei);
+            assert(e != nullptr);
+            assert(e->_src_vertex_i.has_value());
+            _dfs_topological_order(e->_src_vertex_i.value(), visited_i, order);
+        }
+        order.push_back(vertex_i);
+    }
 
     std::optional<size_t> _add_input()
     {
         DEBUG("adding input...");
 
-        assert(_inputs_i.size() <= settings.n_inputs);
-        if (_inputs_i.size() == settings.n_inputs) {
+        assert(_inputs_i->size() <= _settings->n_inputs);
+        if (_inputs_i->size() == _settings->n_inputs) {
             return {};
         }
 
-        const size_t vi   = _g.add_vertex(Neuron(settings.neuron_afid));
-        const size_t in_i = _inputs_i.add(vi);
-        assert(_inputs_i.size() <= settings.n_inputs);
+        const size_t vi =
+                _g.mut().add_vertex(Neuron(_settings->neuron_afid, *_afs));
+        _biases.mut(vi)   = 0;
+        const size_t in_i = _inputs_i.mut().add(vi);
+        assert(_inputs_i->size() <= _settings->n_inputs);
         return in_i;
     }
 
@@ -500,28 +2424,30 @@ private:
     {
         DEBUG("removing input...");
 
-        assert(_inputs_i.contains_i(i));
-        const size_t vi = *_inputs_i.at(i);
-        assert(!_outputs_i.contains(vi));
-        assert(!_hidden_i.contains(vi));
-        assert(_g.contains_vertex_i(vi));
+        assert(_inputs_i->contains_i(i));
+        const size_t vi = *_inputs_i->at(i);
+        assert(!_outputs_i->contains(vi));
+        assert(!_hidden_i->contains(vi));
+        assert(_g->contains_vertex_i(vi));
         // this will also update records in edges and adjucent vertices in _g
-        _g.remove_vertex(vi);
-        _inputs_i.remove(i);
+        _g.mut().remove_vertex(vi);
+        _inputs_i.mut().remove(i);
     }
 
     std::optional<size_t> _add_output()
     {
         DEBUG("adding output...");
 
-        assert(_outputs_i.size() <= settings.n_outputs);
-        if (_outputs_i.size() == settings.n_outputs) {
+        assert(_outputs_i->size() <= _settings->n_outputs);
+        if (_outputs_i->size() == _settings->n_outputs) {
             return {};
         }
 
-        const size_t vi    = _g.add_vertex(Neuron(settings.neuron_afid));
-        const size_t out_i = _outputs_i.add(vi);
-        assert(_outputs_i.size() <= settings.n_outputs);
+        const size_t vi =
+                _g.mut().add_vertex(Neuron(_settings->neuron_afid, *_afs));
+        _biases.mut(vi)    = 0;
+        const size_t out_i = _outputs_i.mut().add(vi);
+        assert(_outputs_i->size() <= _settings->n_outputs);
         return out_i;
     }
 
@@ -529,28 +2455,30 @@ private:
     {
         DEBUG("removing output...");
 
-        assert(_outputs_i.contains_i(i));
-        const size_t vi = *_outputs_i.at(i);
-        assert(!_inputs_i.contains(vi));
-        assert(!_hidden_i.contains(vi));
-        assert(_g.contains_vertex_i(vi));
+        assert(_outputs_i->contains_i(i));
+        const size_t vi = *_outputs_i->at(i);
+        assert(!_inputs_i->contains(vi));
+        assert(!_hidden_i->contains(vi));
+        assert(_g->contains_vertex_i(vi));
         // this will also update records in edges and adjucent vertices in _g
-        _g.remove_vertex(vi);
-        _outputs_i.remove(i);
+        _g.mut().remove_vertex(vi);
+        _outputs_i.mut().remove(i);
     }
 
     std::optional<size_t> _add_hidden()
     {
         DEBUG("adding hidden...");
 
-        assert(_hidden_i.size() <= settings.max_n_hidden);
-        if (_hidden_i.size() == settings.max_n_hidden) {
+        assert(_hidden_i->size() <= _settings->max_n_hidden);
+        if (_hidden_i->size() == _settings->max_n_hidden) {
             return {};
         }
 
-        const size_t vi    = _g.add_vertex(Neuron(settings.neuron_afid));
-        const size_t hid_i = _hidden_i.add(vi);
-        assert(_hidden_i.size() <= settings.max_n_hidden);
+        const size_t vi =
+                _g.mut().add_vertex(Neuron(_settings->neuron_afid, *_afs));
+        _biases.mut(vi)    = 0;
+        const size_t hid_i = _hidden_i.mut().add(vi);
+        assert(_hidden_i->size() <= _settings->max_n_hidden);
         return hid_i;
     }
 
@@ -558,14 +2486,14 @@ private:
     {
         DEBUG("removing hidden...");
 
-        assert(_hidden_i.contains_i(i));
-        const size_t vi = *_hidden_i.at(i);
-        assert(!_inputs_i.contains(vi));
-        assert(!_outputs_i.contains(vi));
-        assert(_g.contains_vertex_i(vi));
+        assert(_hidden_i->contains_i(i));
+        const size_t vi = *_hidden_i->at(i);
+        assert(!_inputs_i->contains(vi));
+        assert(!_outputs_i->contains(vi));
+        assert(_g->contains_vertex_i(vi));
         // this will also update records in edges and adjucent vertices in _g
-        _g.remove_vertex(vi);
-        _hidden_i.remove(i);
+        _g.mut().remove_vertex(vi);
+        _hidden_i.mut().remove(i);
     }
 
     // this function is needed, as the graph itself is not aware of
@@ -574,40 +2502,46 @@ private:
     {
         DEBUG("adding connection...");
 
-        if (_outputs_i.contains(src_vi) || _inputs_i.contains(dst_vi) ||
+        if (_outputs_i->contains(src_vi) || _inputs_i->contains(dst_vi) ||
             dst_vi == src_vi) {
             return {};
         }
 
         // add edge
-        const double init_weight = rnd_in_range(settings.min_init_weight,
-                                                settings.max_init_weight);
-        return _g.add_edge(Connection(src_vi, dst_vi, init_weight));
+        const double init_weight = rnd_in_range(_settings->min_init_weight,
+                                                _settings->max_init_weight);
+        const std::optional<size_t> ei =
+                _g.mut().add_edge(Connection(src_vi, dst_vi));
+        if (ei.has_value()) {
+            _weights.mut(ei.value()) = init_weight;
+        }
+        return ei;
     }
 
     size_t _rm_connection(size_t ei)
     {
         DEBUG("removing connection...");
 
-        assert(_g.contains_edge_i(ei));
+        assert(_g->contains_edge_i(ei));
 
         // this will also update records in adjucent vertices in _g
-        return _g.remove_edge(ei);
+        return _g.mut().remove_edge(ei);
     }
 
     void _step_weight(size_t ei)
     {
         DEBUG("stepping weight...");
 
-        assert(_g.n_edges() > 0);
-        auto* e = _g.edge_at(ei);
-        assert(e != nullptr);
-        const double weight_step = rnd_in_range(settings.min_weight_step,
-                                                settings.max_weight_step);
-        e->weight += weight_step;
-        if (settings.limit_weight) {
-            e->weight = std::min(e->weight, settings.max_weight);
-            e->weight = std::max(e->weight, settings.min_weight);
+        assert(_g->n_edges() > 0);
+        assert(_g->contains_edge_i(ei));
+        const double weight_step = rnd_in_range(_settings->min_weight_step,
+                                                _settings->max_weight_step);
+
+        double& weight = _weights.mut(ei);
+        weight += weight_step;
+        if (_settings->limit_weight) {
+            weight = std::min(weight, _settings->max_weight);
+            weight = std::max(weight, _settings->min_weight);
         }
     }
 
@@ -615,15 +2549,16 @@ private:
     {
         DEBUG("stepping bias...");
 
-        assert(_g.n_vertices() > 0);
-        auto* v = _g.vertex_at(vi);
-        assert(v != nullptr);
-        const double bias_step =
-                rnd_in_range(settings.min_bias_step, settings.max_bias_step);
-        v->bias += bias_step;
-        if (settings.limit_bias) {
-            v->bias = std::min(v->bias, settings.max_bias);
-            v->bias = std::max(v->bias, settings.min_bias);
+        assert(_g->n_vertices() > 0);
+        assert(_g->contains_vertex_i(vi));
+        const double bias_step = rnd_in_range(_settings->min_bias_step,
+                                              _settings->max_bias_step);
+
+        double& bias = _biases.mut(vi);
+        bias += bias_step;
+        if (_settings->limit_bias) {
+            bias = std::min(bias, _settings->max_bias);
+            bias = std::max(bias, _settings->min_bias);
         }
     }
 
@@ -631,21 +2566,230 @@ private:
     {
         DEBUG("randomizing weight...");
 
-        assert(_g.n_edges() > 0);
-        auto* e = _g.edge_at(ei);
-        assert(e != nullptr);
-        e->weight = rnd_in_range(settings.min_weight, settings.max_weight);
+        assert(_g->n_edges() > 0);
+        assert(_g->contains_edge_i(ei));
+        _weights.mut(ei) =
+                rnd_in_range(_settings->min_weight, _settings->max_weight);
     }
 
     void _rnd_bias(size_t vi)
     {
         DEBUG("randomizing bias...");
 
-        assert(_g.n_vertices() > 0);
-        auto* v = _g.vertex_at(vi);
-        assert(v != nullptr);
-        v->bias = rnd_in_range(settings.min_bias, settings.max_bias);
+        assert(_g->n_vertices() > 0);
+        assert(_g->contains_vertex_i(vi));
+        _biases.mut(vi) =
+                rnd_in_range(_settings->min_bias, _settings->max_bias);
+    }
+};
+
+// samples to evaluate a network on, stored sample-major
+struct Dataset {
+    size_t n_inputs  = 0;
+    size_t n_outputs = 0;
+    // n_samples x n_inputs
+    std::vector<double> inputs;
+    // n_samples x n_outputs
+    std::vector<double> targets;
+
+    Dataset(size_t in_n_inputs, size_t in_n_outputs) :
+        n_inputs(in_n_inputs),
+        n_outputs(in_n_outputs)
+    {
+        assert(n_inputs > 0);
+        assert(n_outputs > 0);
+    }
+
+    size_t n_samples() const
+    {
+        return inputs.size() / n_inputs;
+    }
+
+    void add(std::span<const double> sample_inputs,
+             std::span<const double> sample_targets)
+    {
+        assert(sample_inputs.size() == n_inputs);
+        assert(sample_targets.size() == n_outputs);
+        inputs.insert(
+                inputs.end(), sample_inputs.begin(), sample_inputs.end());
+        targets.insert(
+                targets.end(), sample_targets.begin(), sample_targets.end());
+    }
+};
+
+// compensated sum (kahan-babuska), the error stays independent of the
+// number of terms
+struct KahanSum {
+    double sum          = 0;
+    double compensation = 0;
+
+    void add(double x)
+    {
+        const double t = sum + x;
+        if (std::abs(sum) >= std::abs(x)) {
+            compensation += (sum - t) + x;
+        }
+        else {
+            compensation += (x - t) + sum;
+        }
+        sum = t;
+    }
+
+    double value() const
+    {
+        return sum + compensation;
+    }
+};
+
+// computes losses of a network over a dataset in a single streaming pass.
+// the dataset is inferred batch by batch, errors are reduced as soon as
+// a batch is ready, so the full output matrix is never stored.
+// buffers and accumulators are kept between calls, evaluating datasets
+// that are not larger than the previous ones does not allocate
+class LossEvaluator {
+public:
+    enum LossID {
+        LOSS_MSE = 0,
+        LOSS_MAE,
+        LOSS_MAX_ERROR,
+        N_LOSSES,
+    };
+
+    struct Losses {
+        double mse       = 0;
+        double mae       = 0;
+        double max_error = 0;
+
+        double get(LossID id) const
+        {
+            switch (id) {
+                case LOSS_MSE:
+                    return mse;
+                case LOSS_MAE:
+                    return mae;
+                case LOSS_MAX_ERROR:
+                    return max_error;
+                case N_LOSSES:
+                default:
+                    assert(false);
+                    break;
+            }
+            return 0;
+        }
+    };
+
+    // called with output - target of every output of a sample
+    typedef std::function<void(size_t sample_i, std::span<const double>)>
+            ErrorsF;
+
+    size_t batch_len;
+
+    LossEvaluator(size_t in_batch_len = 256) :
+        batch_len(in_batch_len)
+    {
+        assert(batch_len > 0);
+    }
+
+    // return losses over all outputs, per output losses are available
+    // with output_losses()
+    const Losses& evaluate(const Plan& plan,
+                           const Dataset& dataset,
+                           const ErrorsF& on_errors = {})
+    {
+        TRACE_SCOPE("LossEvaluator::evaluate");
+
+        const size_t n_inputs  = dataset.n_inputs;
+        const size_t n_outputs = dataset.n_outputs;
+        const size_t n_samples = dataset.n_samples();
+        assert(plan.input_slots.size() == n_inputs);
+        assert(plan.output_slots.size() == n_outputs);
+
+        if (_outputs.size() < batch_len * n_outputs) {
+            _outputs.resize(batch_len * n_outputs);
+        }
+        _sum_sq.assign(n_outputs, KahanSum());
+        _sum_abs.assign(n_outputs, KahanSum());
+        _output_losses.assign(n_outputs, Losses());
+
+        for (size_t begin = 0; begin < n_samples; begin += batch_len) {
+            const size_t len = std::min(batch_len, n_samples - begin);
+            const std::span<double> outputs(_outputs.data(), len * n_outputs);
+            plan.infer_batch(
+                    std::span(dataset.inputs).subspan(begin * n_inputs,
+                                                      len * n_inputs),
+                    outputs,
+                    len,
+                    _ws);
+
+            // errors overwrite outputs in place
+            const double* targets = dataset.targets.data() + begin * n_outputs;
+            for (size_t i = 0; i < len * n_outputs; i++) {
+                outputs[i] -= targets[i];
+            }
+
+            for (size_t b = 0; b < len; b++) {
+                const std::span<const double> errors =
+                        outputs.subspan(b * n_outputs, n_outputs);
+                for (size_t o = 0; o < n_outputs; o++) {
+                    const double abs_error = std::abs(errors[o]);
+                    _sum_sq[o].add(errors[o] * errors[o]);
+                    _sum_abs[o].add(abs_error);
+                    _output_losses[o].max_error =
+                            std::max(_output_losses[o].max_error, abs_error);
+                }
+                if (on_errors) {
+                    on_errors(begin + b, errors);
+                }
+            }
+        }
+
+        _losses = Losses();
+        KahanSum sum_sq;
+        KahanSum sum_abs;
+        for (size_t o = 0; o < n_outputs; o++) {
+            if (n_samples > 0) {
+                _output_losses[o].mse = _sum_sq[o].value() / n_samples;
+                _output_losses[o].mae = _sum_abs[o].value() / n_samples;
+            }
+            sum_sq.add(_sum_sq[o].value());
+            sum_abs.add(_sum_abs[o].value());
+            _losses.max_error =
+                    std::max(_losses.max_error, _output_losses[o].max_error);
+        }
+        if (n_samples > 0) {
+            _losses.mse = sum_sq.value() / (n_samples * n_outputs);
+            _losses.mae = sum_abs.value() / (n_samples * n_outputs);
+        }
+        return _losses;
+    }
+
+    // compiles the network on every call, which allocates. prefer
+    // compiling once and passing the Plan when evaluating the same
+    // network more than once, see examples/find_sin.cpp
+    const Losses& evaluate(const Network& network,
+                           const Dataset& dataset,
+                           const ErrorsF& on_errors = {})
+    {
+        return evaluate(network.compile(), dataset, on_errors);
     }
+
+    const Losses& losses() const
+    {
+        return _losses;
+    }
+
+    const std::vector<Losses>& output_losses() const
+    {
+        return _output_losses;
+    }
+
+private:
+    Plan::Workspace _ws;
+    std::vector<double> _outputs;
+    std::vector<KahanSum> _sum_sq;
+    std::vector<KahanSum> _sum_abs;
+    std::vector<Losses> _output_losses;
+    Losses _losses;
 };
 
 }  // namespace tante